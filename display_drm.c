@@ -0,0 +1,259 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+#include "debug.h"
+#include "display_output.h"
+
+// 输出到DRM设备。用内核里的DRM client(和fbdev模拟一样)建一个dumb framebuffer，
+// 设置模式以后CPU直接写映射出来的内存；单缓冲时改过的区域通过framebuffer的dirty
+// 提交，atomic helper会把它们变成FB_DAMAGE_CLIPS，支持局部刷新的驱动只刷改过的地方。
+// 可以在没有显示硬件的vkms上调试
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0) && IS_ENABLED(CONFIG_DRM)
+
+#include <drm/drm_client.h>
+#include <drm/drm_device.h>
+#include <drm/drm_file.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_modes.h>
+
+#ifndef DRM_MAJOR
+#define DRM_MAJOR 226
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+#include <linux/iosys-map.h>
+typedef struct iosys_map drm_output_map;
+#else
+#include <linux/dma-buf-map.h>
+typedef struct dma_buf_map drm_output_map;
+#endif
+
+static char *drm_card = "/dev/dri/card0";
+module_param(drm_card, charp, S_IRUGO);
+MODULE_PARM_DESC(drm_card, "drm device node used by output=drm");
+
+// 设备节点只在打开时用来找到DRM设备，之后由client拿着设备的引用。
+// 打开主节点的文件会成为DRM master，拿着它时client的commit会返回-EBUSY，
+// 所以找到设备就放掉文件。fput要等insmod回到用户态才真正关掉文件，
+// 第一次提交模式推迟到第一次画的时候(在工作队列里)
+struct drm_output
+{
+    struct drm_client_dev client;
+    struct drm_client_buffer *buffer;
+    int height;
+    int mode_set;               // 模式已经提交过
+};
+
+// 所有CRTC都显示framebuffer里从第page页开始的部分
+static int drm_output_pan(struct display_output *out, int page)
+{
+    struct drm_output *drm = out->priv;
+    struct drm_mode_set *modeset;
+    int ret;
+
+    mutex_lock(&drm->client.modeset_mutex);
+    drm_client_for_each_modeset(modeset, &drm->client)
+    {
+        modeset->x = 0;
+        modeset->y = page*drm->height;
+    }
+    mutex_unlock(&drm->client.modeset_mutex);
+
+    // 阻塞的atomic commit，返回时已经翻过去了
+    ret = drm_client_modeset_commit(&drm->client);
+    if (ret)
+    {
+        // 别的程序(X、weston等)是DRM master时设置不了模式
+        if (!drm->mode_set)
+            ERR("drm modeset commit fail(%d)\n", ret);
+        return ret;
+    }
+    drm->mode_set = 1;
+    return 0;
+}
+
+static void drm_output_flush(struct display_output *out, int page, const struct display_rect *rects, int count)
+{
+    struct drm_output *drm = out->priv;
+    struct drm_framebuffer *fb = drm->buffer->fb;
+    struct drm_clip_rect clips[DAMAGE_MAX];
+    int i, ret;
+
+    // 单缓冲时不会翻页，第一次画的时候把模式设上
+    if (!drm->mode_set && drm_output_pan(out, 0))
+        return;
+    if (!fb->funcs->dirty)
+        return;
+
+    for (i=0; i<count; i++)
+    {
+        clips[i].x1 = rects[i].x;
+        clips[i].y1 = page*drm->height + rects[i].y;
+        clips[i].x2 = rects[i].x + rects[i].w;
+        clips[i].y2 = page*drm->height + rects[i].y + rects[i].h;
+    }
+
+    ret = fb->funcs->dirty(fb, drm->client.file, 0, 0, clips, count);
+    if (ret)
+        ERR("drm dirty fail(%d)\n", ret);
+}
+
+static void drm_output_close(struct display_output *out)
+{
+    struct drm_output *drm = out->priv;
+
+    drm_client_buffer_vunmap(drm->buffer);
+    drm_client_framebuffer_delete(drm->buffer);
+    drm_client_release(&drm->client);
+    kfree(drm);
+}
+
+static const struct display_output_ops drm_output_ops = {
+    .close = drm_output_close,
+    .pan = drm_output_pan,
+    .flush = drm_output_flush,
+};
+
+int display_drm_open(struct display_output *out, int page_flip)
+{
+    struct drm_output *drm;
+    struct drm_file *file_priv;
+    struct file *filp;
+    struct drm_mode_set *modeset;
+    struct drm_display_mode *mode = NULL;
+    drm_output_map map;
+    int width = 0, height = 0, vrefresh = 0;
+    int pages;
+    int ret;
+
+    drm = kzalloc(sizeof(*drm), GFP_KERNEL);
+    if (!drm)
+        return -ENOMEM;
+
+    filp = filp_open(drm_card, O_RDWR, 0);
+    if (IS_ERR(filp))
+    {
+        ERR("open %s fail(%ld)\n", drm_card, PTR_ERR(filp));
+        ret = PTR_ERR(filp);
+        goto FREE;
+    }
+    if (imajor(file_inode(filp)) != DRM_MAJOR)
+    {
+        ERR("%s is not a drm device\n", drm_card);
+        fput(filp);
+        ret = -ENODEV;
+        goto FREE;
+    }
+    file_priv = filp->private_data;
+
+    // client拿着设备的引用，文件马上放掉，不要一直当DRM master
+    ret = drm_client_init(file_priv->minor->dev, &drm->client, "usb_display", NULL);
+    fput(filp);
+    if (ret)
+    {
+        ERR("drm client init fail(%d)\n", ret);
+        goto FREE;
+    }
+
+    // 按已连接的显示器挑模式，多个显示器时用第一个的分辨率
+    ret = drm_client_modeset_probe(&drm->client, 0, 0);
+    if (ret)
+    {
+        ERR("drm modeset probe fail(%d)\n", ret);
+        goto RELEASE;
+    }
+    mutex_lock(&drm->client.modeset_mutex);
+    drm_client_for_each_modeset(modeset, &drm->client)
+    {
+        if (modeset->mode)
+        {
+            mode = modeset->mode;
+            break;
+        }
+    }
+    if (mode)
+    {
+        width = mode->hdisplay;
+        height = mode->vdisplay;
+        vrefresh = drm_mode_vrefresh(mode);
+    }
+    mutex_unlock(&drm->client.modeset_mutex);
+    if (!mode)
+    {
+        ERR("%s no connected display\n", drm_card);
+        ret = -ENODEV;
+        goto RELEASE;
+    }
+
+    // 两页放在一个framebuffer里上下排，翻页时改plane的源坐标
+    pages = page_flip ? 2 : 1;
+    drm->buffer = drm_client_framebuffer_create(&drm->client, width, height*pages, DRM_FORMAT_RGB565);
+    if (IS_ERR(drm->buffer) && pages > 1)
+    {
+        ERR("drm can't page flip(%ld), use single buffer\n", PTR_ERR(drm->buffer));
+        pages = 1;
+        drm->buffer = drm_client_framebuffer_create(&drm->client, width, height, DRM_FORMAT_RGB565);
+    }
+    if (IS_ERR(drm->buffer))
+    {
+        ERR("drm create framebuffer fail(%ld)\n", PTR_ERR(drm->buffer));
+        ret = PTR_ERR(drm->buffer);
+        goto RELEASE;
+    }
+
+    ret = drm_client_buffer_vmap(drm->buffer, &map);
+    if (ret)
+    {
+        ERR("drm vmap fail(%d)\n", ret);
+        goto DELETE;
+    }
+
+    mutex_lock(&drm->client.modeset_mutex);
+    drm_client_for_each_modeset(modeset, &drm->client)
+    {
+        if (modeset->mode)
+            modeset->fb = drm->buffer->fb;
+    }
+    mutex_unlock(&drm->client.modeset_mutex);
+
+    drm->height = height;
+    out->ops = &drm_output_ops;
+    out->name = drm_card;
+    out->priv = drm;
+    out->base = map.is_iomem ? (unsigned char __iomem *)map.vaddr_iomem : (unsigned char __iomem *)map.vaddr;
+    out->line_length = drm->buffer->fb->pitches[0];
+    out->page_size = height*out->line_length;
+    out->width = width;
+    out->height = height;
+    out->pages = pages;
+    out->frame_ns = NSEC_PER_SEC/(vrefresh > 0 ? vrefresh : 60);
+
+    if (map.is_iomem)
+        memset_io(map.vaddr_iomem, 0, out->page_size*pages);
+    else
+        memset(map.vaddr, 0, out->page_size*pages);
+    return 0;
+
+DELETE:
+    drm_client_framebuffer_delete(drm->buffer);
+RELEASE:
+    drm_client_release(&drm->client);
+FREE:
+    kfree(drm);
+    return ret;
+}
+
+#else
+
+int display_drm_open(struct display_output *out, int page_flip)
+{
+    ERR("drm output needs linux 5.11 or later with CONFIG_DRM\n");
+    return -ENODEV;
+}
+
+#endif
@@ -0,0 +1,283 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/console.h>
+#include <linux/version.h>
+#include <linux/fb.h>
+#include <linux/notifier.h>
+#include <linux/slab.h>
+
+#include "debug.h"
+#include "protocol.h"
+#include "display_output.h"
+
+// 输出到fb0。填充和拷贝交给fb驱动的fb_fillrect/fb_copyarea，
+// 有2D引擎的用硬件，没有的也是按字长优化过的cfb_/sys_函数，比逐像素写快。
+// fbdev没有给内核用的等vblank的接口，FBIO_WAITFORVSYNC只能从用户态调，所以按fb时序算出的刷新周期节拍
+
+struct fb_output
+{
+    struct fb_info *fb;
+    struct display_output *out;
+    struct notifier_block blank_nb;
+};
+
+static inline struct fb_info *fb_output_info(struct display_output *out)
+{
+    return ((struct fb_output *)out->priv)->fb;
+}
+
+static int fb_output_pan(struct display_output *out, int page)
+{
+    struct fb_info *fb = fb_output_info(out);
+    struct fb_var_screeninfo var = fb->var;
+    int ret;
+
+    var.xoffset = 0;
+    var.yoffset = page*var.yres;
+    var.activate = FB_ACTIVATE_VBL;
+    mutex_lock(&fb->lock);
+    console_lock();
+    ret = fb_pan_display(fb, &var);
+    console_unlock();
+    mutex_unlock(&fb->lock);
+    return ret;
+}
+
+// 16bpp的RGB565，和CPU画的像素格式一样
+static int fb_output_rgb565(const struct fb_var_screeninfo *var)
+{
+    return var->bits_per_pixel == 16 &&
+           var->red.offset == 11 && var->red.length == 5 &&
+           var->green.offset == 5 && var->green.length == 6 &&
+           var->blue.offset == 0 && var->blue.length == 5;
+}
+
+static int fb_output_fill(struct display_output *out, int page, const struct display_rect *r,
+                          unsigned short color, int operation)
+{
+    struct fb_info *fb = fb_output_info(out);
+    u32 *palette = fb->pseudo_palette;
+    struct fb_fillrect rect;
+    u32 save;
+
+    // truecolor时fb_fillrect的color是pseudo_palette的下标，不是像素值；
+    // 直接把RGB565放进调色板，只有fb0也是RGB565时才对
+    if (!fb->fbops->fb_fillrect || !palette ||
+        (fb->fix.visual != FB_VISUAL_TRUECOLOR && fb->fix.visual != FB_VISUAL_DIRECTCOLOR) ||
+        !fb_output_rgb565(&fb->var))
+        return -EOPNOTSUPP;
+
+    switch (operation)
+    {
+    case RPUSBDISP_OPERATION_COPY:
+        rect.rop = ROP_COPY;
+        break;
+    case RPUSBDISP_OPERATION_XOR:
+        rect.rop = ROP_XOR;
+        break;
+    default:
+        return -EOPNOTSUPP;
+    }
+
+    rect.dx = r->x;
+    rect.dy = page*out->height + r->y;
+    rect.width = r->w;
+    rect.height = r->h;
+    rect.color = 0;
+
+    // 借用0号调色板，fbcon也是拿着console锁画的，这期间不会用到它
+    console_lock();
+    save = palette[0];
+    palette[0] = color;
+    fb->fbops->fb_fillrect(fb, &rect);
+    palette[0] = save;
+    console_unlock();
+    return 0;
+}
+
+static int fb_output_copy(struct display_output *out, int src_page, const struct display_rect *r,
+                          int dst_page, int dx, int dy)
+{
+    struct fb_info *fb = fb_output_info(out);
+    struct fb_copyarea area;
+
+    if (!fb->fbops->fb_copyarea)
+        return -EOPNOTSUPP;
+
+    area.sx = r->x;
+    area.sy = src_page*out->height + r->y;
+    area.dx = dx;
+    area.dy = dst_page*out->height + dy;
+    area.width = r->w;
+    area.height = r->h;
+
+    // 2D引擎和fbcon共用，跟fbcon一样在console锁里操作
+    console_lock();
+    fb->fbops->fb_copyarea(fb, &area);
+    console_unlock();
+    return 0;
+}
+
+static void fb_output_sync(struct display_output *out)
+{
+    struct fb_info *fb = fb_output_info(out);
+
+    if (fb->fbops->fb_sync)
+        fb->fbops->fb_sync(fb);
+}
+
+static void fb_output_close(struct display_output *out)
+{
+    struct fb_output *fbo = out->priv;
+    struct fb_info *fb = fbo->fb;
+
+#ifdef FB_EVENT_BLANK
+    fb_unregister_client(&fbo->blank_nb);
+#endif
+
+    // 翻回第0页，给其它用fb0的程序
+    if (out->pages > 1 && fb->var.yoffset)
+        fb_output_pan(out, 0);
+
+    if (fb->fbops->fb_release)
+        fb->fbops->fb_release(fb, 0);
+    module_put(fb->fbops->owner);
+    kfree(fbo);
+}
+
+static const struct display_output_ops fb_output_ops = {
+    .close = fb_output_close,
+    .fill = fb_output_fill,
+    .copy = fb_output_copy,
+    .sync = fb_output_sync,
+    .pan = fb_output_pan,
+};
+
+#ifdef FB_EVENT_BLANK
+// 关屏(FBIOBLANK)时通知f_display，fb的notifier链在console锁里调用，只转告一下
+static int fb_output_blank_event(struct notifier_block *nb, unsigned long event, void *data)
+{
+    struct fb_output *fbo = container_of(nb, struct fb_output, blank_nb);
+    struct fb_event *evdata = data;
+
+    if (event != FB_EVENT_BLANK || evdata->info != fbo->fb || !fbo->out->blank)
+        return NOTIFY_DONE;
+
+    fbo->out->blank(fbo->out, *(int *)evdata->data != FB_BLANK_UNBLANK);
+    return NOTIFY_OK;
+}
+#endif
+
+// 打开page_flip时把fb0的虚拟高度设成两倍
+static void fb_output_flip_init(struct display_output *out)
+{
+    struct fb_info *fb = fb_output_info(out);
+    struct fb_var_screeninfo var;
+    int ret = 0;
+
+    if (fb->var.yres_virtual < fb->var.yres*2)
+    {
+        var = fb->var;
+        var.yres_virtual = var.yres*2;
+        var.yoffset = 0;
+        var.activate = FB_ACTIVATE_NOW;
+        mutex_lock(&fb->lock);
+        console_lock();
+        ret = fb_set_var(fb, &var);
+        console_unlock();
+        mutex_unlock(&fb->lock);
+    }
+
+    if (ret || fb->var.yres_virtual < fb->var.yres*2 || !fb->fix.ypanstep ||
+        fb->fix.smem_len < fb->fix.line_length*fb->var.yres*2)
+    {
+        ERR("fb0 can't page flip(%d), use single buffer\n", ret);
+        return;
+    }
+
+    if (fb->var.yoffset && fb_output_pan(out, 0))
+    {
+        ERR("fb0 pan fail, use single buffer\n");
+        return;
+    }
+    out->pages = 2;
+}
+
+// 由fb的时序算刷新周期，算不出来按60Hz
+static u64 fb_output_frame_ns(struct fb_info *fb)
+{
+    struct fb_var_screeninfo *var = &fb->var;
+    u64 frame_ns = 0;
+
+    if (var->pixclock)
+    {
+        // pixclock单位是ps
+        frame_ns = (u64)var->pixclock *
+            (var->xres + var->left_margin + var->right_margin + var->hsync_len) *
+            (var->yres + var->upper_margin + var->lower_margin + var->vsync_len);
+        do_div(frame_ns, 1000);
+    }
+    if (frame_ns < NSEC_PER_SEC/240 || frame_ns > NSEC_PER_SEC/10)
+        frame_ns = NSEC_PER_SEC/60;
+    return frame_ns;
+}
+
+int display_fb_open(struct display_output *out, int page_flip)
+{
+    struct fb_info *fb0 = registered_fb[0];
+    struct fb_output *fbo;
+
+    if (!fb0)
+    {
+        ERR("no fb0\n");
+        return -ENODEV;
+    }
+
+    fbo = kzalloc(sizeof(*fbo), GFP_KERNEL);
+    if (!fbo)
+        return -ENOMEM;
+    fbo->fb = fb0;
+    fbo->out = out;
+
+    if (fb0->fbops->owner && !try_module_get(fb0->fbops->owner))
+    {
+        ERR("get framebuffer module error\n");
+        kfree(fbo);
+        return -ENODEV;
+    }
+
+    if (fb0->fbops->fb_open)
+    {
+        mutex_lock(&fb0->lock);
+        if (fb0->fbops->fb_open(fb0, 0))
+        {
+            ERR("fb0 open fail\n");
+            mutex_unlock(&fb0->lock);
+            module_put(fb0->fbops->owner);
+            kfree(fbo);
+            return -EBUSY;
+        }
+        mutex_unlock(&fb0->lock);
+    }
+
+    out->ops = &fb_output_ops;
+    out->name = "fb0";
+    out->priv = fbo;
+    out->pages = 1;
+    if (page_flip)
+        fb_output_flip_init(out);
+
+    out->base = (unsigned char __iomem *)fb0->screen_base;
+    out->line_length = fb0->fix.line_length;
+    out->page_size = fb0->var.yres*fb0->fix.line_length;
+    out->width = fb0->var.xres;
+    out->height = fb0->var.yres;
+    out->frame_ns = fb_output_frame_ns(fb0);
+
+#ifdef FB_EVENT_BLANK
+    fbo->blank_nb.notifier_call = fb_output_blank_event;
+    fb_register_client(&fbo->blank_nb);
+#endif
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef __DISPLAY_OUTPUT_H__
+#define __DISPLAY_OUTPUT_H__
+
+// 一帧内记录的更新区域个数，超过后合并
+#define DAMAGE_MAX 16
+
+struct display_rect
+{
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
+struct display_output;
+
+// 输出后端。像素都由f_display用CPU直接写到base里，
+// 填充和拷贝可以交给后端加速，函数为NULL或者返回非0时f_display用CPU画
+struct display_output_ops
+{
+    void (*close)(struct display_output *out);
+
+    // 填充page页上的区域，operation是RPUSBDISP_OPERATION_xxx
+    int (*fill)(struct display_output *out, int page, const struct display_rect *r,
+                unsigned short color, int operation);
+    // 把src_page页上的区域拷到dst_page页的(dx,dy)，同一页上可以重叠
+    int (*copy)(struct display_output *out, int src_page, const struct display_rect *r,
+                int dst_page, int dx, int dy);
+    // 等加速的操作完成，之后CPU才能读写像素
+    void (*sync)(struct display_output *out);
+
+    // 显示第page页，pages大于1时才会调用
+    int (*pan)(struct display_output *out, int page);
+    // 等下一个vblank，不支持返回非0，f_display改成按frame_ns节拍
+    int (*wait_vsync)(struct display_output *out);
+    // CPU改了正在显示的page页上这些区域(最多DAMAGE_MAX个)，需要主动刷新的后端(DRM)提交给显示控制器
+    void (*flush)(struct display_output *out, int page, const struct display_rect *rects, int count);
+};
+
+struct display_output
+{
+    const struct display_output_ops *ops;
+    const char *name;
+
+    unsigned char __iomem *base;    // 第0页，第n页在base + n*page_size
+    unsigned int line_length;
+    unsigned int page_size;
+    int width;
+    int height;
+    int pages;                      // 2表示可以双缓冲翻页
+    u64 frame_ns;                   // 刷新周期
+    int discard;                    // 画图的命令不解码直接丢掉，只测接收速度
+
+    void *priv;
+
+    // 由f_display在打开前设置: 显示器关了(blanked=1)或者又打开了，后端知道时调用
+    void (*blank)(struct display_output *out, int blanked);
+};
+
+// 绑定fb0，page_flip时尝试把虚拟高度设成两倍
+int display_fb_open(struct display_output *out, int page_flip);
+// 通过DRM client在drm_card上建一个framebuffer并设置模式，page_flip时建两倍高
+int display_drm_open(struct display_output *out, int page_flip);
+// 画到内存里，null时不等vblank，画图的命令也不解码
+int display_ram_open(struct display_output *out, int page_flip, int null);
+
+#endif
@@ -0,0 +1,83 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "debug.h"
+#include "display_output.h"
+
+// 画到内存里，不需要fb驱动和显示硬件，在dummy_hcd上单独测USB接收和解码的速度。
+// ram按ram_refresh的节拍翻页和刷新，和接了屏幕时一样；null不等vblank，bitblt、填充、拷贝收完就丢掉，
+// 不解码也不写像素，测的是不算解码的接收速度。内存还是要分配，光标和图块CRC会读写它
+
+static unsigned int ram_width = 800;
+module_param(ram_width, uint, S_IRUGO);
+MODULE_PARM_DESC(ram_width, "width of the output=ram/null surface");
+
+static unsigned int ram_height = 480;
+module_param(ram_height, uint, S_IRUGO);
+MODULE_PARM_DESC(ram_height, "height of the output=ram/null surface");
+
+static unsigned int ram_refresh = 60;
+module_param(ram_refresh, uint, S_IRUGO);
+MODULE_PARM_DESC(ram_refresh, "simulated refresh rate of output=ram (Hz)");
+
+static int ram_output_pan(struct display_output *out, int page)
+{
+    return 0;
+}
+
+// 没有vblank可等，马上返回
+static int ram_output_wait_vsync(struct display_output *out)
+{
+    return 0;
+}
+
+static void ram_output_close(struct display_output *out)
+{
+    vfree(out->priv);
+}
+
+static const struct display_output_ops ram_output_ops = {
+    .close = ram_output_close,
+    .pan = ram_output_pan,
+};
+
+static const struct display_output_ops null_output_ops = {
+    .close = ram_output_close,
+    .pan = ram_output_pan,
+    .wait_vsync = ram_output_wait_vsync,
+};
+
+int display_ram_open(struct display_output *out, int page_flip, int null)
+{
+    unsigned char *surface;
+    int pages = page_flip ? 2 : 1;
+
+    if (!ram_width || !ram_height || ram_width > 4096 || ram_height > 4096)
+    {
+        ERR("bad ram surface %ux%u\n", ram_width, ram_height);
+        return -EINVAL;
+    }
+
+    surface = vzalloc(ram_width*ram_height*2*pages);
+    if (!surface)
+    {
+        ERR("no memory for %ux%u ram surface\n", ram_width, ram_height);
+        return -ENOMEM;
+    }
+
+    out->ops = null ? &null_output_ops : &ram_output_ops;
+    out->name = null ? "null" : "ram";
+    out->priv = surface;
+    out->base = (unsigned char __iomem *)surface;
+    out->line_length = ram_width*2;
+    out->page_size = ram_height*out->line_length;
+    out->width = ram_width;
+    out->height = ram_height;
+    out->pages = pages;
+    out->frame_ns = NSEC_PER_SEC/(ram_refresh ? ram_refresh : 60);
+    out->discard = null;
+    return 0;
+}
@@ -0,0 +1,207 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <linux/log2.h>
+
+#include "debug.h"
+#include "display_ring.h"
+
+// 写的时候只多一次memcpy(从USB收的buffer拷到记录区)，读的程序直接在映射的内存里看，不用每条记录一次系统调用
+
+struct display_ring
+{
+    struct miscdevice misc;
+    struct display_ring_header *hdr;    // vmalloc_user的第0页
+    unsigned char *data;                // 第1页开始的记录区
+    unsigned int size;
+    unsigned int off;                   // 下一条记录在记录区里的位置
+    u32 seq;
+    atomic_t users;                     // 打开的文件数，0时不导出
+    wait_queue_head_t wait;
+};
+
+// 每个打开的文件上次poll时看到的head
+struct display_ring_file
+{
+    struct display_ring *ring;
+    u32 seen;
+};
+
+static int display_ring_open(struct inode *inode, struct file *file)
+{
+    struct display_ring *ring = container_of(file->private_data, struct display_ring, misc);
+    struct display_ring_file *rf;
+
+    rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+    if (!rf)
+        return -ENOMEM;
+    rf->ring = ring;
+    rf->seen = ring->hdr->head;
+    file->private_data = rf;
+    atomic_inc(&ring->users);
+    return nonseekable_open(inode, file);
+}
+
+// 映射还在时文件不会被释放
+static int display_ring_release(struct inode *inode, struct file *file)
+{
+    struct display_ring_file *rf = file->private_data;
+
+    atomic_dec(&rf->ring->users);
+    kfree(rf);
+    return 0;
+}
+
+// 只读映射，长度不超过头加记录区
+static int display_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct display_ring *ring = ((struct display_ring_file *)file->private_data)->ring;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE + ring->size)
+        return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, ring->hdr, 0);
+}
+
+// 上次poll以后有新的记录就可读
+static unsigned int display_ring_poll(struct file *file, poll_table *wait)
+{
+    struct display_ring_file *rf = file->private_data;
+    struct display_ring *ring = rf->ring;
+    u32 head;
+
+    poll_wait(file, &ring->wait, wait);
+#ifdef READ_ONCE
+    head = READ_ONCE(ring->hdr->head);
+#else
+    head = ACCESS_ONCE(ring->hdr->head);
+#endif
+    if (head == rf->seen)
+        return 0;
+    rf->seen = head;
+    return POLLIN | POLLRDNORM;
+}
+
+static const struct file_operations display_ring_fops = {
+    .owner = THIS_MODULE,
+    .open = display_ring_open,
+    .release = display_ring_release,
+    .mmap = display_ring_mmap,
+    .poll = display_ring_poll,
+};
+
+// 在记录区的off处写一条记录，写之前先把writing推过去，读的程序能发现被覆盖
+static void display_ring_put(struct display_ring *ring, int cmd, const void *head, int head_size,
+                             const void *payload, int payload_size, unsigned int size)
+{
+    struct display_ring_header *hdr = ring->hdr;
+    struct display_ring_record *rec = (struct display_ring_record *)(ring->data + ring->off);
+    u32 pos = hdr->head;
+
+    hdr->writing = pos + size;
+    smp_wmb();
+
+    rec->size = size;
+    rec->seq = cmd == DISPLAY_RING_PAD ? ring->seq : ring->seq++;
+    rec->cmd = cmd;
+    rec->head_size = head_size;
+    rec->payload_size = payload_size;
+    rec->time_ns = ktime_to_ns(ktime_get());
+    rec->reserved = 0;
+    if (head_size)
+        memcpy(rec + 1, head, head_size);
+    if (payload_size)
+        memcpy((unsigned char *)(rec + 1) + head_size, payload, payload_size);
+
+    smp_wmb();
+    if (cmd != DISPLAY_RING_PAD)
+        hdr->last = pos;
+    hdr->head = pos + size;
+    ring->off += size;
+    if (ring->off == ring->size)
+        ring->off = 0;
+}
+
+void display_ring_write(struct display_ring *ring, int cmd, const void *head, int head_size,
+                        const void *payload, int payload_size)
+{
+    unsigned int size = ALIGN(sizeof(struct display_ring_record) + head_size + payload_size, DISPLAY_RING_ALIGN);
+
+    if (!atomic_read(&ring->users))
+        return;
+    if (size > ring->size)
+    {
+        ring->hdr->dropped++;
+        return;
+    }
+
+    // 记录不跨过记录区末尾，剩下的地方填一条空记录
+    if (ring->off + size > ring->size)
+        display_ring_put(ring, DISPLAY_RING_PAD, NULL, 0, NULL, 0, ring->size - ring->off);
+    display_ring_put(ring, cmd, head, head_size, payload, payload_size, size);
+    wake_up_interruptible(&ring->wait);
+}
+
+struct display_ring *display_ring_create(unsigned int size)
+{
+    struct display_ring *ring;
+    int ret;
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return ERR_PTR(-ENOMEM);
+
+    // head绕回时对size取余要连续
+    ring->size = rounddown_pow_of_two(max_t(unsigned int, size, PAGE_SIZE));
+    ring->hdr = vmalloc_user(PAGE_SIZE + ring->size);
+    if (!ring->hdr)
+    {
+        ret = -ENOMEM;
+        goto FREE;
+    }
+    ring->data = (unsigned char *)ring->hdr + PAGE_SIZE;
+    ring->hdr->magic = DISPLAY_RING_MAGIC;
+    ring->hdr->version = DISPLAY_RING_VERSION;
+    ring->hdr->size = ring->size;
+    init_waitqueue_head(&ring->wait);
+
+    ring->misc.minor = MISC_DYNAMIC_MINOR;
+    ring->misc.name = "usb_display";
+    ring->misc.fops = &display_ring_fops;
+    ret = misc_register(&ring->misc);
+    if (ret)
+    {
+        ERR("register /dev/usb_display fail(%d)\n", ret);
+        goto VFREE;
+    }
+    return ring;
+
+VFREE:
+    vfree(ring->hdr);
+FREE:
+    kfree(ring);
+    return ERR_PTR(ret);
+}
+
+// 有程序打开着时模块卸载不了，走到这里时已经没有映射了
+void display_ring_destroy(struct display_ring *ring)
+{
+    misc_deregister(&ring->misc);
+    vfree(ring->hdr);
+    kfree(ring);
+}
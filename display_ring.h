@@ -0,0 +1,56 @@
+#ifndef __DISPLAY_RING_H__
+#define __DISPLAY_RING_H__
+
+// /dev/usb_display把主机发来的更新原样导出给用户程序(录屏、远程查看等)。
+// mmap以后第0页是display_ring_header，从第1页开始是size字节的记录区，
+// 每条记录是display_ring_record加上包头和数据，按收到的顺序排。
+// 记录区写满后从头覆盖，读得慢会丢记录，不会挡住显示。
+//
+// 读的方法: 自己记一个位置pos(初始为head)，pos != head时pos对size取余处读一条记录，
+// 读完(拷出来或用完)以后再看writing，writing - pos > size说明读的时候被覆盖了，这条作废，
+// 从last重新开始；没被覆盖就pos += record.size。追上head以后poll等新的记录。
+// head、writing、last是32位的，32位的CPU上也能一次读完，导出4GB以后绕回0，
+// 比较时都用无符号的差(writing - pos)，不要直接比大小。size是2的幂，绕回时取余的位置是连续的。
+// 没有程序打开/dev/usb_display时不导出，head停着不动。
+
+#define DISPLAY_RING_MAGIC      0x44505552  // "RUPD"
+#define DISPLAY_RING_VERSION    2
+#define DISPLAY_RING_ALIGN      32          // 记录的大小和位置都是32的倍数
+#define DISPLAY_RING_PAD        0xffff      // 记录区末尾放不下时的填充记录
+
+struct display_ring_header
+{
+    __u32 magic;
+    __u32 version;
+    __u32 size;             // 记录区大小，2的幂
+    __u32 dropped;          // 比记录区还大，没导出的更新个数
+    __u32 head;             // 已经写完的字节数，一直增长(会绕回)，对size取余是记录区里的位置
+    __u32 writing;          // 正在写的记录的结尾，[head, writing)里的旧内容正在被覆盖
+    __u32 last;             // 最后一条写完的记录的位置
+};
+
+struct display_ring_record
+{
+    __u32 size;             // 整条记录，包括这个头和对齐的填充
+    __u32 seq;              // 每条加1，可以看出丢了多少
+    __u16 cmd;              // RPUSBDISP_DISPCMD_xxx，或者DISPLAY_RING_PAD
+    __u16 head_size;        // 后面先是包头(和USB上一样)
+    __u32 payload_size;     // 再是数据(bitblt的像素等)
+    __u64 time_ns;          // 收完的时间(CLOCK_MONOTONIC)
+    __u64 reserved;
+};
+
+#ifdef __KERNEL__
+
+struct display_ring;
+
+// 建一个记录区的队列，注册成/dev/usb_display，size不是2的幂时往下取
+struct display_ring *display_ring_create(unsigned int size);
+void display_ring_destroy(struct display_ring *ring);
+// 只在工作队列里调用，没有程序打开时直接返回
+void display_ring_write(struct display_ring *ring, int cmd, const void *head, int head_size,
+                        const void *payload, int payload_size);
+
+#endif
+
+#endif
@@ -4,33 +4,255 @@
 #include <linux/interrupt.h>
 #include <linux/err.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
 #include <linux/usb/composite.h>
 #include <linux/fb.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/crc32.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+#if IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#include <linux/lz4.h>
+#endif
 
 #include "debug.h"
 #include "f_display.h"
 #include "protocol.h"
+#include "display_output.h"
+#include "display_ring.h"
 
 #define RP_DISP_DEFAULT_HEIGHT      480
 #define RP_DISP_DEFAULT_WIDTH       800
 #define RP_DISP_DEFAULT_PIXEL_BITS  16
+#define RP_DISP_BYTES_PER_PIXEL     (RP_DISP_DEFAULT_PIXEL_BITS/8)
 
 // 但版本大于1.04时，新加了cmd=5协议，在原有的bitblt基础上加了压缩算法，以128字节为一个段，消耗一字节做重复计数
-#define __BUFFER_SIZE  (RP_DISP_DEFAULT_HEIGHT*RP_DISP_DEFAULT_WIDTH*RP_DISP_DEFAULT_PIXEL_BITS/8)
-#define BUFFER_SIZE (__BUFFER_SIZE+(((__BUFFER_SIZE>>1) + 0x7f)>>7))
+// 一个buffer要放得下各种编码最坏情况下的整屏bitblt，按输出后端的分辨率算:
+// rle每128个像素一字节段头，2D rle全是原样的段时每64个像素一字节，lz4压不下来时比原始数据还大一点
+static inline int display_buffer_size(int width, int height)
+{
+    int pixels = width*height;
+    int size = pixels*RP_DISP_BYTES_PER_PIXEL;
+    int rle = size + (((size>>1) + 0x7f)>>7);
+    int rle2d = size + DIV_ROUND_UP(pixels, RPUSBDISP_RLE2D_COUNT_BIT + 1);
+    int lz4 = size + size/255 + 16;
+
+    return max3(rle, rle2d, lz4);
+}
+
+#define BUFFER_COUNT 64      // 排队的更新最多这么多个，数据放在按页分配的buffer池里
+#define SCRATCH_COUNT 2      // 同时画了一半的更新最多两个: 按顺序画的和插队画的
+
+// buffer池的内存。vmalloc是一页一页映射的，收数据的memcpy和画的时候一个整屏的更新要换190多次TLB；
+// pages是物理连续的高阶页，在内核的线性映射里(ARM上按1MB的section映射)，以后也可以直接做DMA；
+// huge是用大页映射的vmalloc，体系结构支持时才有
+enum
+{
+    POOL_VMALLOC,
+    POOL_PAGES,
+    POOL_HUGE,
+};
 
-#define BUFFER_COUNT 2
+static const char *display_pool_names[] = {
+    [POOL_VMALLOC] = "vmalloc",
+    [POOL_PAGES] = "pages",
+    [POOL_HUGE] = "huge",
+};
 #define USB_BULK_MAX_PACKET 512
 
+// 大的更新每次最多画这么多像素，然后看看有没有小的更新要插队
+#define BLIT_SLICE_PIXELS (64*RP_DISP_DEFAULT_WIDTH)
+
+// display_buffer_rect返回的更新属性
+#define UPDATE_OPAQUE   0x1     // 完全盖住目标区域，不依赖原来的内容
+#define UPDATE_READ     0x2     // 要读屏幕上的内容(copy area)
+#define UPDATE_URGENT   0x4     // 主机标了加急
+
+// 主机时间戳和本地时间差超过这个值就重新对时，避免主机时钟跳变时卡住
+#define PRESENT_MAX_US (500*USEC_PER_MSEC)
+
 // USB TOUCH包大小用于interrupt endpoint
 #define USB_TOUCH_PACKET_SIZE sizeof(rpusbdisp_status_normal_packet_t)
 
+// 双缓冲: fb0的虚拟高度设为两倍，更新画到后台页，主机发commit时pan_display翻页
+static bool page_flip;
+module_param(page_flip, bool, S_IRUGO);
+MODULE_PARM_DESC(page_flip, "double buffered page flipping, frames shown on host commit");
+
+// 输出后端: fb、drm，或者测试用的ram/null
+static char *output = "fb";
+module_param(output, charp, S_IRUGO);
+MODULE_PARM_DESC(output, "output backend: fb (registered_fb[0]), drm (see drm_card), ram or null (memory only, for benchmarking)");
+
+// 带时间戳的帧最多缓冲多久，用来吸收USB传输的抖动
+static unsigned int present_delay_ms = 20;
+module_param(present_delay_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(present_delay_ms, "jitter buffer depth for timestamped frames (ms)");
+
+// 不超过这个面积的更新(光标、输入光标等)当作加急，可以插到大的更新前面
+static unsigned int urgent_pixels = 64*64;
+module_param(urgent_pixels, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(urgent_pixels, "updates up to this many pixels may overtake larger ones");
+
+// 屏幕竖着装时设备端旋转，主机按转过以后的分辨率发数据
+static unsigned int rotate;
+module_param(rotate, uint, S_IRUGO);
+MODULE_PARM_DESC(rotate, "rotate the picture and touch clockwise by 0, 90, 180 or 270 degrees");
+
+// 主机断开这么久以后释放接收buffer，下次连上再分配，0表示不释放
+static unsigned int buffer_idle_s = 30;
+module_param(buffer_idle_s, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(buffer_idle_s, "free the receive buffers this many seconds after the host disconnects, 0 to keep them");
+
+// 排队的更新的数据总共最多占多少内存，0表示两个最坏情况的整屏bitblt，至少一个整屏
+static unsigned int buffer_kb;
+module_param(buffer_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(buffer_kb, "memory for queued updates in KB, 0 for two full frames");
+
+// buffer池用什么内存，auto按pages、huge、vmalloc的顺序试
+static char *buffer_alloc = "auto";
+module_param(buffer_alloc, charp, S_IRUGO);
+MODULE_PARM_DESC(buffer_alloc, "memory for the update buffer pool: auto, pages (physically contiguous), huge (vmalloc with huge mappings) or vmalloc");
+
+// 缓存的图块总共最多占多少内存，超过后丢掉最久没画过的
+static unsigned int tile_cache_kb = 1024;
+module_param(tile_cache_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(tile_cache_kb, "memory budget of the tile cache (KiB)");
+
+#define TILE_HASH_BITS 8
+
+// 把收到的更新导出到/dev/usb_display，0表示不导出
+static unsigned int ring_kb;
+module_param(ring_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_kb, "size of the update ring exported as /dev/usb_display (KiB), 0 to disable");
+
+// 调色板查表时每次转这么多像素再拷贝，也是RLE一段的最大长度
+#define INDEXED_CHUNK 128
+// yuv每次转换这么多像素再写到屏幕，要是偶数
+#define YUV_CHUNK 128
+
+// 旋转时每次攒这么多行再转置，也是转置分块的大小，16个像素正好一条cache line
+#define ROTATE_STRIP_ROWS 16
+
+struct f_display;
+
+// 画像素到矩形区域，按行换行
+struct display_blit
+{
+    unsigned char __iomem *dst;
+    unsigned int line_length;
+    unsigned int width;
+    unsigned int col;
+    unsigned int rows;
+
+    // 旋转时先按行解到strip里，攒够ROTATE_STRIP_ROWS行再分块转置写到屏幕
+    struct f_display *display;
+    unsigned short *strip;
+    struct display_rect rect;   // strip第0行的逻辑坐标
+    unsigned int strip_rows;
+    int page;
+
+    // 放大时先把源图的一行解到row里，解完一行再放大画到scale_to
+    struct display_blit *scale_to;
+    unsigned short *row;
+    unsigned short *prev;       // bilinear还要用上一行
+    unsigned short *expand;     // 放大以后的一行
+    int scale;
+    int filter;
+    int row_index;
+};
+
+// 画一个更新时用的行缓冲，开始画时拿一份，画完还回去
+struct display_scratch
+{
+    int used;
+    unsigned short *strip;      // rotate时才分配
+    unsigned short *scale_rows; // 放大用的3行，2D rle用前两行
+};
+
 struct display_buffer
 {
     volatile int cmd;
     volatile int count;
+    volatile int done;          // 已经画完，等前面的buffer画完后一起释放
+    // 大的更新分段画，记录画到哪里了
+    int started;
+    int offset;
+    struct display_blit blit;
+    struct display_blit src_blit;   // 放大和2D rle的bitblt先按行解到这里
+    struct display_scratch *scratch;
+    int unpacked_len;
     unsigned char head[16];
-    unsigned char buffer[BUFFER_SIZE];
+    unsigned char *buffer;      // 在buffer池里
+    int page;                   // 占buffer池的第page页开始的pages页
+    int pages;
+    int skip;                   // 绕回开头时池末尾空出来的页
+};
+
+// 8位/4位调色板下标查表成RGB565
+struct display_palette
+{
+    unsigned short color[RPUSBDISP_PALETTE_SIZE];
+    u32 pair[256];              // 4位时一个字节查出两个像素，高4位在前
+};
+
+// 主机存下来反复画的图块(图标、字形条等)，按id查
+struct display_tile
+{
+    struct hlist_node node;
+    struct list_head lru;       // 最近画过的在前面
+    u32 id;
+    int width;
+    int height;
+    unsigned short pixels[];
+};
+
+struct display_tile_cache
+{
+    struct hlist_head hash[1 << TILE_HASH_BITS];
+    struct list_head lru;
+    unsigned int bytes;
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+};
+
+// 每种bitblt编码的统计，在debugfs里看压缩率和解码速度
+struct display_codec_stats
+{
+    u64 commands;
+    u64 bytes;                  // USB上收到的，包括包头
+    u64 pixels;                 // 画到屏幕上的
+    u64 ns;                     // 解码和画的时间
+};
+
+// 光标层，主机上传一次图像以后只发位置，由设备自己叠加和恢复被盖住的内容
+struct display_cursor
+{
+    int x;                      // 热点位置
+    int y;
+    int visible;
+    int width;
+    int height;
+    int hot_x;
+    int hot_y;
+    unsigned short image[RPUSBDISP_CURSOR_MAX_SIZE*RPUSBDISP_CURSOR_MAX_SIZE];
+    unsigned char alpha[RPUSBDISP_CURSOR_MAX_SIZE*RPUSBDISP_CURSOR_MAX_SIZE];
+
+    // 每一页上画了没有，画在哪里，以及被盖住的内容
+    int drawn[2];
+    struct display_rect rect[2];
+    unsigned short save[2][RPUSBDISP_CURSOR_MAX_SIZE*RPUSBDISP_CURSOR_MAX_SIZE];
 };
 
 struct f_display
@@ -39,21 +261,106 @@ struct f_display
 	struct usb_ep		*in_ep;
 	struct usb_ep		*out_ep;
 
-    // bind framebuffer
-    struct fb_info *fb;
+    // 输出后端
+    struct display_output out;
+    int width;                  // 主机看到的屏幕，rotate为90/270时和输出后端的宽高对调
+    int height;
+    int accel_pending;          // 有加速的操作还没等完成
 
     // circular buffer
     volatile struct display_buffer *buffer_head;
     volatile struct display_buffer *buffer_tail;
     struct display_buffer *buffers;
+    int buffer_size;            // 一个更新的数据最多这么多字节(最坏情况的整屏bitblt)
+    // 更新的数据按页放在pool里，按收到的顺序循环使用。开始接收时按包头估计的最大长度
+    // 预留连续的页，收完以后只占实际用到的页，几KB的小更新可以排几十个
+    unsigned char *pool;
+    int pool_mode;              // POOL_xxx
+    int pool_pages;
+    int pool_head;              // 下一个空闲页
+    int pool_tail;              // 最早的更新的第一页
+    int pool_used;              // 占用的页，包括绕回开头时末尾空出来的
+    int reserve_page;           // buffer_head预留的位置
+    int reserve_skip;
+    int reserve_size;
+    struct display_scratch scratch[SCRATCH_COUNT];
+    // lz4整屏解压用的缓冲只有一份，第一次收到lz4时才分配，和buffer池一起释放。
+    // 一个lz4更新分段画完之前别的lz4更新不能开始
+    unsigned char *lz4_unpacked;
+    struct display_buffer *lz4_owner;
+    // buffer的数据和各种行缓冲在第一次连上时分配，断开buffer_idle_s秒后释放。
+    // set_alt在中断里，分配交给工作队列，分配好以后才放OUT请求，之前主机一直收到NAK。
+    // 分配不到时留着请求隔一秒再试
+    int buffers_ready;
+    int connected;
+    int alloc_failed;           // 失败只报一次
+    struct usb_request *pending_req;
+    struct delayed_work alloc_work;
+    struct delayed_work idle_work;
+    // 已接收完还没画的buffer个数，满了以后暂不放回OUT请求，让主机NAK等待
+    int buffer_used;
+    int receiving;              // buffer_head正在接收一个多包的命令
+    struct usb_request *stalled_req;
+    int stalled_unread;         // stalled_req里的包还没收，buffer池腾出地方以后再收
+    spinlock_t lock;
+
+    struct workqueue_struct *wq;
+    struct work_struct work;
+
+    // page flip
+    int flip_capable;
+    int flip_active;
+    volatile int session_reset; // 重新连接后回到单缓冲，等主机的第一个commit
+    int front;                  // 当前显示的页(0/1)
+    int damage_count;           // 当前帧(后台页)的更新区域
+    struct display_rect damage[DAMAGE_MAX];
+    int flush_count;            // 前台页上还没提交给输出后端的区域
+    struct display_rect flush[DAMAGE_MAX];
+    ktime_t flush_last;
+
+    // vsync
+    int hw_vsync;               // 输出后端能等vblank
+    ktime_t vsync_period;
+    ktime_t vsync_last;
+
+    // 主机时间戳对应的本地时间
+    int present_synced;
+    u32 present_base_ts;
+    ktime_t present_base;
+    int present_pending;        // page flip模式下，下一个commit要等到present_time
+    ktime_t present_time;
+
+    struct display_palette palette;
+
+    struct display_tile_cache tiles;
+
+    // 显示器关着时不画，记下主机画了哪些地方，打开后通过状态包让主机重发
+    volatile int blanked;
+    volatile int unblanked;
+    int blank_damage_count;     // 用display->lock保护，setup里会读
+    struct display_rect blank_damage[DAMAGE_MAX];
+    struct usb_request *status_req;
+    int status_busy;
+
+    // 算图块CRC时拷出来的像素，只在setup里用
+    unsigned short crc_buf[RPUSBDISP_CRC_TILE_SIZE*RPUSBDISP_CRC_TILE_SIZE];
+
+    struct display_ring *ring;  // ring_kb为0时NULL
+
+    struct dentry *debugfs;
+    struct display_codec_stats stats[RPUSBDISP_CMD_MASK+1];
+
+    // cursor，cursor_x/y/visible由中断里收到的命令设置，工作队列拿去画
+    struct display_cursor cursor;
+    int cursor_x;
+    int cursor_y;
+    int cursor_visible;
+    int cursor_dirty;
 
     // for debug
     volatile int irq_count;
 };
 
-static void display_do_tasklet(unsigned long);
-DECLARE_TASKLET(display_tasklet, display_do_tasklet, 0);
-
 static inline struct f_display *func_to_display(struct usb_function *f)
 {
 	return container_of(f, struct f_display, function);
@@ -158,6 +465,43 @@ static void disable_ep(struct usb_composite_dev *cdev, struct usb_ep *ep)
 	}
 }
 
+static void display_status_complete(struct usb_ep *ep, struct usb_request *req)
+{
+    struct f_display *display = req->context;
+    unsigned long flags;
+
+    spin_lock_irqsave(&display->lock, flags);
+    display->status_busy = 0;
+    spin_unlock_irqrestore(&display->lock, flags);
+}
+
+// 在IN端点上发一个状态包，上一个还没被主机取走时丢掉
+static void display_status_send(struct f_display *display, int display_status)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    struct usb_request *req = display->status_req;
+    rpusbdisp_status_normal_packet_t *p = req->buf;
+    unsigned long flags;
+    int status;
+
+    spin_lock_irqsave(&display->lock, flags);
+    if (display->status_busy || display->in_ep->driver_data != display)
+    {
+        spin_unlock_irqrestore(&display->lock, flags);
+        return;
+    }
+    memset(p, 0, sizeof(*p));
+    p->header.packet_type = RPUSBDISP_STATUS_TYPE_NORMAL;
+    p->display_status = display_status;
+    p->touch_status = RPUSBDISP_TOUCH_STATUS_NO_TOUCH;
+    status = usb_ep_queue(display->in_ep, req, GFP_ATOMIC);
+    if (!status)
+        display->status_busy = 1;
+    spin_unlock_irqrestore(&display->lock, flags);
+    if (status)
+        ERR_DEV(cdev, "%s queue status --> %d\n", display->in_ep->name, status);
+}
+
 static int display_bind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct usb_composite_dev *cdev = c->cdev;
@@ -198,73 +542,378 @@ autoconf_fail:
 	if (ret)
 		return ret;
 
+    // IN端点上只发状态包，一个请求够了
+    display->status_req = usb_ep_alloc_request(display->in_ep, GFP_KERNEL);
+    if (display->status_req)
+    {
+        display->status_req->buf = kzalloc(USB_TOUCH_PACKET_SIZE, GFP_KERNEL);
+        if (!display->status_req->buf)
+        {
+            usb_ep_free_request(display->in_ep, display->status_req);
+            display->status_req = NULL;
+        }
+    }
+    if (!display->status_req)
+    {
+        usb_free_all_descriptors(f);
+        return -ENOMEM;
+    }
+    display->status_req->length = USB_TOUCH_PACKET_SIZE;
+    display->status_req->context = display;
+    display->status_req->complete = display_status_complete;
+
 	DBG_DEV(cdev, "%s speed %s: IN/%s, OUT/%s\n",
 	     (gadget_is_dualspeed(c->cdev->gadget) ? "high" : "full"),
 			f->name, display->in_ep->name, display->out_ep->name);
 	return 0;
 }
 
-static void display_complete(struct usb_ep *ep, struct usb_request *req)
+// 带数据的命令的包头长度，不带数据的命令返回0
+static int display_cmd_head_size(int cmd)
 {
-	struct f_display	*display = ep->driver_data;
-	struct usb_composite_dev *cdev = display->function.config->cdev;
-	int	status = req->status;
-	switch (status) {
-	case 0:/* normal completion? */
-		if (ep == display->out_ep) {
-            //DBG_DEV(cdev, "receive data %d irq:%ld\n", req->actual, in_interrupt());
-            unsigned char cmd = ((unsigned char *)req->buf)[0];
-            if ((cmd&RPUSBDISP_CMD_MASK) == RPUSBDISP_DISPCMD_BITBLT ||
-                (cmd&RPUSBDISP_CMD_MASK) == RPUSBDISP_DISPCMD_BITBLT_RLE)
+    switch (cmd)
+    {
+    case RPUSBDISP_DISPCMD_BITBLT:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE:
+    case RPUSBDISP_DISPCMD_BITBLT_LZ4:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE2D:
+        return sizeof(rpusbdisp_disp_bitblt_packet_t);
+    case RPUSBDISP_DISPCMD_CURSOR_IMAGE:
+        return sizeof(rpusbdisp_disp_cursor_image_packet_t);
+    case RPUSBDISP_DISPCMD_BITBLT_SCALED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED:
+        return sizeof(rpusbdisp_disp_bitblt_scaled_packet_t);
+    case RPUSBDISP_DISPCMD_PALETTE:
+        return sizeof(rpusbdisp_disp_palette_packet_t);
+    case RPUSBDISP_DISPCMD_BITBLT_INDEXED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_INDEXED:
+        return sizeof(rpusbdisp_disp_bitblt_indexed_packet_t);
+    case RPUSBDISP_DISPCMD_BITBLT_YUV420:
+        return sizeof(rpusbdisp_disp_bitblt_yuv_packet_t);
+    case RPUSBDISP_DISPCMD_TILE_STORE:
+        return sizeof(rpusbdisp_disp_tile_store_packet_t);
+    }
+    return 0;
+}
+
+static int display_cmd_is_blit(int cmd)
+{
+    switch (cmd)
+    {
+    case RPUSBDISP_DISPCMD_BITBLT:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE:
+    case RPUSBDISP_DISPCMD_BITBLT_SCALED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED:
+    case RPUSBDISP_DISPCMD_BITBLT_INDEXED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_INDEXED:
+    case RPUSBDISP_DISPCMD_BITBLT_YUV420:
+    case RPUSBDISP_DISPCMD_BITBLT_LZ4:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE2D:
+        return 1;
+    }
+    return 0;
+}
+
+// 只有包头的短命令的包长度，其它命令返回0
+static int display_cmd_short_size(int cmd)
+{
+    switch (cmd)
+    {
+    case RPUSBDISP_DISPCMD_FILL:
+        return sizeof(rpusbdisp_disp_fill_packet_t);
+    case RPUSBDISP_DISPCMD_RECT:
+        return sizeof(rpusbdisp_disp_fillrect_packet_t);
+    case RPUSBDISP_DISPCMD_COPY_AREA:
+        return sizeof(rpusbdisp_disp_copyarea_packet_t);
+    case RPUSBDISP_DISPCMD_COMMIT:
+        return sizeof(rpusbdisp_disp_packet_header_t);
+    case RPUSBDISP_DISPCMD_PRESENT:
+        return sizeof(rpusbdisp_disp_present_packet_t);
+    case RPUSBDISP_DISPCMD_TILE_DRAW:
+        return sizeof(rpusbdisp_disp_tile_draw_packet_t);
+    }
+    return 0;
+}
+
+// 一个更新的数据最多多少字节，开始接收时在buffer池里预留这么多
+static int display_payload_max(struct f_display *display, int cmd, const void *head)
+{
+    int size = display->buffer_size;
+
+    if (display_cmd_is_blit(cmd))
+    {
+        const rpusbdisp_disp_bitblt_packet_t *p = head;
+        // 各种编码每个像素都不超过3字节: 2D rle最坏一个操作码加一个颜色，lz4最坏比原始数据多0.4%
+        size = le16_to_cpu(p->width)*le16_to_cpu(p->height)*3 + 64;
+    }
+    else if (cmd == RPUSBDISP_DISPCMD_TILE_STORE)
+    {
+        const rpusbdisp_disp_tile_store_packet_t *p = head;
+        size = le16_to_cpu(p->width)*le16_to_cpu(p->height)*RP_DISP_BYTES_PER_PIXEL;
+    }
+    else if (cmd == RPUSBDISP_DISPCMD_CURSOR_IMAGE)
+    {
+        // 图像后面跟每个像素一字节的alpha
+        const rpusbdisp_disp_cursor_image_packet_t *p = head;
+        size = le16_to_cpu(p->width)*le16_to_cpu(p->height)*(RP_DISP_BYTES_PER_PIXEL + 1);
+    }
+    else if (cmd == RPUSBDISP_DISPCMD_PALETTE)
+    {
+        const rpusbdisp_disp_palette_packet_t *p = head;
+        size = le16_to_cpu(p->count)*RP_DISP_BYTES_PER_PIXEL;
+    }
+    return min(size, display->buffer_size);
+}
+
+// 在buffer池里给buffer_head预留size字节连续的页(至少一页，一个包总放得下)，
+// 放不下时req挂起，等工作队列画完前面的更新腾出地方再收这个包，返回0
+static int display_pool_reserve(struct f_display *display, int size, struct usb_request *req)
+{
+    int pages = max_t(int, DIV_ROUND_UP(size, PAGE_SIZE), 1);
+    unsigned long flags;
+    int ok = 1;
+
+    spin_lock_irqsave(&display->lock, flags);
+    if (!display->pool_used)
+    {
+        display->pool_head = 0;
+        display->pool_tail = 0;
+    }
+    display->reserve_skip = 0;
+    if (display->pool_used == display->pool_pages)
+    {
+        ok = 0;
+    }
+    else if (display->pool_head >= display->pool_tail)
+    {
+        // 空闲的是head到池末尾和开头到tail两段，末尾放不下就绕回开头
+        if (display->pool_pages - display->pool_head < pages)
+        {
+            display->reserve_skip = display->pool_pages - display->pool_head;
+            ok = display->pool_tail >= pages;
+        }
+    }
+    else
+    {
+        ok = display->pool_tail - display->pool_head >= pages;
+    }
+    display->reserve_page = display->reserve_skip ? 0 : display->pool_head;
+    display->reserve_size = pages*PAGE_SIZE;
+    if (!ok)
+    {
+        display->stalled_req = req;
+        display->stalled_unread = 1;
+    }
+    spin_unlock_irqrestore(&display->lock, flags);
+
+    display->buffer_head->buffer = display->pool + display->reserve_page*PAGE_SIZE;
+    return ok;
+}
+
+// 收完以后只占实际用到的页，在display->lock里调用
+static void display_pool_commit(struct f_display *display, struct display_buffer *buf)
+{
+    buf->page = display->reserve_page;
+    buf->pages = DIV_ROUND_UP(buf->count, PAGE_SIZE);
+    buf->skip = buf->pages ? display->reserve_skip : 0;
+    display->pool_used += buf->skip + buf->pages;
+    if (buf->pages)
+        display->pool_head = (buf->page + buf->pages) % display->pool_pages;
+}
+
+// 画完的更新按收到的顺序还回buffer池，在display->lock里调用
+static void display_pool_free(struct f_display *display, struct display_buffer *buf)
+{
+    display->pool_used -= buf->skip + buf->pages;
+    if (buf->pages)
+        display->pool_tail = (buf->page + buf->pages) % display->pool_pages;
+}
+
+// 当前buffer接收完成，交给工作队列去画
+// 返回1表示循环buffer已满，req先不放回端点，等工作队列腾出buffer再放
+static int display_buffer_publish(struct f_display *display, struct usb_request *req)
+{
+    unsigned long flags;
+    int stalled = 0;
+
+    display->buffer_head->started = 0;
+    display->buffer_head->done = 0;
+
+    spin_lock_irqsave(&display->lock, flags);
+    display_pool_commit(display, (struct display_buffer *)display->buffer_head);
+    circular_buffer_incr(display, &display->buffer_head);
+    if (++display->buffer_used == BUFFER_COUNT)
+    {
+        display->stalled_req = req;
+        stalled = 1;
+    }
+    spin_unlock_irqrestore(&display->lock, flags);
+
+    display->receiving = 0;
+    display->irq_count++;
+    queue_work(display->wq, &display->work);
+    return stalled;
+}
+
+static int display_receive(struct f_display *display, struct usb_request *req);
+
+// 工作队列画完一个buffer，放回被挂起的OUT请求
+static void display_buffer_release(struct f_display *display)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    struct usb_request *req;
+    unsigned long flags;
+    int status, unread;
+
+    spin_lock_irqsave(&display->lock, flags);
+    display_pool_free(display, (struct display_buffer *)display->buffer_tail);
+    circular_buffer_incr(display, &display->buffer_tail);
+    display->buffer_used--;
+    req = display->stalled_req;
+    unread = display->stalled_unread;
+    display->stalled_req = NULL;
+    display->stalled_unread = 0;
+    spin_unlock_irqrestore(&display->lock, flags);
+
+    // 挂起时端点上没有OUT请求，在这里收不会和display_complete同时进行，还放不下就继续挂起
+    if (req && unread && display_receive(display, req))
+        return;
+
+    if (req)
+    {
+        status = usb_ep_queue(display->out_ep, req, GFP_ATOMIC);
+        if (status)
+        {
+            DBG_DEV(cdev, "%s requeue req --> %d\n", display->out_ep->name, status);
+            free_ep_req(display->out_ep, req);
+        }
+    }
+}
+
+// 收一个OUT包，返回1表示req被挂起，先不放回端点
+static int display_receive(struct f_display *display, struct usb_request *req)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    unsigned char cmd = ((unsigned char *)req->buf)[0];
+    unsigned long flags;
+    int stalled = 0;
+
+    //DBG_DEV(cdev, "receive data %d irq:%ld\n", req->actual, in_interrupt());
+    if (req->actual == 0)
+    {
+        // 数据刚好是512的整数倍时，主机用零长度包结束传输
+        if (display->receiving)
+            stalled = display_buffer_publish(display, req);
+    }
+    else if (display_cmd_head_size(cmd&RPUSBDISP_CMD_MASK))
+    {
+        // bitblt直接颜色数组
+        // bitblt_rel用压缩算法，原理是分成最大128字节的段，段头一个字节表示长度和是否是相同颜色
+        if (cmd & RPUSBDISP_CMD_FLAG_START)
+        {
+            //DUMP_MSG(cdev, "recv bitblt", req->buf, req->actual);
+            rpusbdisp_disp_bitblt_packet_t *p = (rpusbdisp_disp_bitblt_packet_t *)req->buf;
+            //p->x = le16_to_cpu(p->x);
+            //p->y = le16_to_cpu(p->y);
+            //p->width = le16_to_cpu(p->width);
+            //p->height = le16_to_cpu(p->height);
+            //DBG_DEV(cdev, "bitblt x:%d y:%d width:%d height:%d\n", p->x, p->y, p->width, p->height);
+            int head_size = display_cmd_head_size(cmd&RPUSBDISP_CMD_MASK);
+            unsigned char *data = (unsigned char *)p + head_size;
+            if (req->actual >= head_size)
             {
-                // bitblt直接颜色数组
-                // bitblt_rel用压缩算法，原理是分成最大128字节的段，段头一个字节表示长度和是否是相同颜色
-                if (cmd & RPUSBDISP_CMD_FLAG_START)
-                {
-                    //DUMP_MSG(cdev, "recv bitblt", req->buf, req->actual);
-                    rpusbdisp_disp_bitblt_packet_t *p = (rpusbdisp_disp_bitblt_packet_t *)req->buf;
-                    //p->x = le16_to_cpu(p->x);
-                    //p->y = le16_to_cpu(p->y);
-                    //p->width = le16_to_cpu(p->width);
-                    //p->height = le16_to_cpu(p->height);
-                    //DBG_DEV(cdev, "bitblt x:%d y:%d width:%d height:%d\n", p->x, p->y, p->width, p->height);
-                    unsigned char *data = (unsigned char *)(p+1);
-                    display->buffer_head->cmd = cmd & RPUSBDISP_CMD_MASK;
-                    display->buffer_head->count = req->actual - sizeof(rpusbdisp_disp_bitblt_packet_t);
-                    memcpy((unsigned char *)(display->buffer_head->head), p, sizeof(rpusbdisp_disp_bitblt_packet_t));
-                    memcpy((unsigned char *)(display->buffer_head->buffer), data, display->buffer_head->count);
-                    //DBG_DEV(cdev, "bitblt cmd:%d count:%d headsize:%d\n", display->buffer_head->cmd, display->buffer_head->count, sizeof(rpusbdisp_disp_bitblt_packet_t));
-                }
-                else
+                if (!display_pool_reserve(display, display_payload_max(display, cmd&RPUSBDISP_CMD_MASK, p), req))
+                    return 1;
+                display->buffer_head->cmd = cmd & RPUSBDISP_CMD_MASK;
+                display->buffer_head->count = req->actual - head_size;
+                memcpy((unsigned char *)(display->buffer_head->head), p, head_size);
+                memcpy((unsigned char *)(display->buffer_head->buffer), data, display->buffer_head->count);
+                display->receiving = 1;
+                //DBG_DEV(cdev, "bitblt cmd:%d count:%d headsize:%d\n", display->buffer_head->cmd, display->buffer_head->count, sizeof(rpusbdisp_disp_bitblt_packet_t));
+
+                // 只有一个包的小更新
+                if (req->actual != USB_BULK_MAX_PACKET)
+                    stalled = display_buffer_publish(display, req);
+            }
+            else
+            {
+                ERR_DEV(cdev, "cmd %d head too short!!\n", cmd&RPUSBDISP_CMD_MASK);
+            }
+        }
+        else if (display->receiving)
+        {
+            rpusbdisp_disp_packet_header_t *p = (rpusbdisp_disp_packet_header_t *)req->buf;
+            unsigned char *data = (unsigned char *)(p+1);
+            int count = req->actual - sizeof(rpusbdisp_disp_packet_header_t);
+            if (count+display->buffer_head->count <= display->reserve_size)
+            {
+                memcpy((unsigned char *)(display->buffer_head->buffer+display->buffer_head->count), data, count);
+                display->buffer_head->count += count;
+                if (req->actual != USB_BULK_MAX_PACKET)
                 {
-                    rpusbdisp_disp_packet_header_t *p = (rpusbdisp_disp_packet_header_t *)req->buf;
-                    unsigned char *data = (unsigned char *)(p+1);
-                    int count = req->actual - sizeof(rpusbdisp_disp_packet_header_t);
-                    if (count+display->buffer_head->count <= BUFFER_SIZE)
-                    {
-                        memcpy((unsigned char *)(display->buffer_head->buffer+display->buffer_head->count), data, count);
-                        display->buffer_head->count += count;
-                        if (req->actual != USB_BULK_MAX_PACKET)
-                        {
-                            // packet end
-                            //DBG_DEV(cdev, "recv sub bitblt cmd:%d count:%d\n", p->cmd_flag, display->buffer_head->count);
-                            circular_buffer_incr(display, &display->buffer_head);
-                            //DBG_DEV(cdev, "bitblt buffer %p %p\n", display->buffer_head, display->buffer_tail);
-                            display_tasklet.data = (unsigned long)(display);
-                            display->irq_count++;
-                            tasklet_schedule(&display_tasklet);
-                        }
-                    }
-                    else
-                    {
-                        ERR_DEV(cdev, "too big!!\n");
-                    }
+                    // packet end
+                    //DBG_DEV(cdev, "recv sub bitblt cmd:%d count:%d\n", p->cmd_flag, display->buffer_head->count);
+                    stalled = display_buffer_publish(display, req);
+                    //DBG_DEV(cdev, "bitblt buffer %p %p\n", display->buffer_head, display->buffer_tail);
                 }
             }
             else
             {
-                ERR_DEV(cdev, "other cmd type!!\n");
+                // 数据格式不对，这个更新丢了，让主机重发整屏
+                ERR_DEV(cdev, "too big!!\n");
+                display->receiving = 0;
+                display_status_send(display, RPUSBDISP_DISPLAY_STATUS_DIRTY_FLAG);
             }
+        }
+    }
+    else if (display_cmd_short_size(cmd&RPUSBDISP_CMD_MASK))
+    {
+        // 只有包头的短命令也进循环buffer，保证和前后的更新顺序一致
+        if (req->actual >= display_cmd_short_size(cmd&RPUSBDISP_CMD_MASK))
+        {
+            display->buffer_head->cmd = cmd & RPUSBDISP_CMD_MASK;
+            display->buffer_head->count = 0;
+            memcpy((unsigned char *)(display->buffer_head->head), req->buf,
+                   display_cmd_short_size(cmd&RPUSBDISP_CMD_MASK));
+            stalled = display_buffer_publish(display, req);
+        }
+        else
+        {
+            ERR_DEV(cdev, "cmd %d too short!!\n", cmd&RPUSBDISP_CMD_MASK);
+        }
+    }
+    else if ((cmd&RPUSBDISP_CMD_MASK) == RPUSBDISP_DISPCMD_CURSOR_MOVE &&
+             req->actual >= sizeof(rpusbdisp_disp_cursor_move_packet_t))
+    {
+        // 光标移动不进循环buffer，不用排在大的更新后面
+        rpusbdisp_disp_cursor_move_packet_t *p = (rpusbdisp_disp_cursor_move_packet_t *)req->buf;
+        spin_lock_irqsave(&display->lock, flags);
+        display->cursor_x = (s16)le16_to_cpu(p->x);
+        display->cursor_y = (s16)le16_to_cpu(p->y);
+        display->cursor_visible = p->visible;
+        display->cursor_dirty = 1;
+        spin_unlock_irqrestore(&display->lock, flags);
+        queue_work(display->wq, &display->work);
+    }
+    else
+    {
+        ERR_DEV(cdev, "other cmd type!!\n");
+    }
+
+    return stalled;
+}
+
+static void display_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct f_display	*display = ep->driver_data;
+	struct usb_composite_dev *cdev = display->function.config->cdev;
+	int	status = req->status;
+	switch (status) {
+	case 0:/* normal completion? */
+		if (ep == display->out_ep) {
+            // 循环buffer满了，req等工作队列画完一个buffer再放回去
+            if (display_receive(display, req))
+                return;
 
             status = usb_ep_queue(display->out_ep, req, GFP_ATOMIC);
             if (status == 0)
@@ -291,12 +940,200 @@ static void display_complete(struct usb_ep *ep, struct usb_request *req)
 	}
 }
 
+static void display_buffers_free(struct f_display *display)
+{
+    int i;
+
+    if (display->pool && display->pool_mode == POOL_PAGES)
+        free_pages_exact(display->pool, display->pool_pages*PAGE_SIZE);
+    else
+        vfree(display->pool);
+    display->pool = NULL;
+    for (i=0; i<SCRATCH_COUNT; i++)
+    {
+        vfree(display->scratch[i].strip);
+        vfree(display->scratch[i].scale_rows);
+        display->scratch[i].strip = NULL;
+        display->scratch[i].scale_rows = NULL;
+    }
+    vfree(display->lz4_unpacked);
+    display->lz4_unpacked = NULL;
+    display->lz4_owner = NULL;
+}
+
+static int display_scratch_alloc(struct display_scratch *scratch, struct f_display *display)
+{
+    scratch->scale_rows = vmalloc(3*display->width*RP_DISP_BYTES_PER_PIXEL);
+    if (!scratch->scale_rows)
+        return -ENOMEM;
+    if (rotate)
+    {
+        scratch->strip = vmalloc(ROTATE_STRIP_ROWS*display->width*RP_DISP_BYTES_PER_PIXEL);
+        if (!scratch->strip)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+// 按buffer_alloc分配buffer池，auto时分配不到连续的内存就往后退
+static unsigned char *display_pool_alloc(struct f_display *display)
+{
+    unsigned long size = display->pool_pages*PAGE_SIZE;
+    int is_auto = !strcmp(buffer_alloc, "auto");
+    void *pool;
+
+    if (is_auto || !strcmp(buffer_alloc, "pages"))
+    {
+        // 超过最大的阶或者内存碎了会失败，不要为它回收内存
+        pool = alloc_pages_exact(size, GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY);
+        if (pool || !is_auto)
+        {
+            display->pool_mode = POOL_PAGES;
+            return pool;
+        }
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+    if (is_auto || !strcmp(buffer_alloc, "huge"))
+    {
+        pool = vmalloc_huge(size, GFP_KERNEL);
+        // 体系结构不支持时vmalloc_huge就是普通的vmalloc
+        if (pool && is_vm_area_hugepages(pool))
+        {
+            display->pool_mode = POOL_HUGE;
+            return pool;
+        }
+        if (pool || !is_auto)
+        {
+            display->pool_mode = POOL_VMALLOC;
+            return pool;
+        }
+    }
+#endif
+    if (!is_auto && strcmp(buffer_alloc, "vmalloc"))
+        ERR("buffer_alloc=%s not supported, use vmalloc\n", buffer_alloc);
+    display->pool_mode = POOL_VMALLOC;
+    return vmalloc_32(size);
+}
+
+static int display_buffers_alloc(struct f_display *display)
+{
+    int i;
+
+    display->pool = display_pool_alloc(display);
+    if (!display->pool)
+        return -ENOMEM;
+    for (i=0; i<SCRATCH_COUNT; i++)
+    {
+        if (display_scratch_alloc(&display->scratch[i], display))
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+// 第一次连上时分配buffer，然后放出enable_display里留下的OUT请求
+static void display_alloc_work(struct work_struct *work)
+{
+    struct f_display *display = container_of(to_delayed_work(work), struct f_display, alloc_work);
+    struct usb_request *req;
+    unsigned long flags;
+    int status;
+
+    if (!display->buffers_ready)
+    {
+        // 重试前主机已经断开，等下次连上再分配
+        if (!display->pending_req)
+            return;
+        if (display_buffers_alloc(display))
+        {
+            if (!display->alloc_failed)
+                ERR("no memory for %lu KB display buffers, retrying\n", display->pool_pages*PAGE_SIZE/1024);
+            display->alloc_failed = 1;
+            display_buffers_free(display);
+            // 请求留在pending_req，主机一直NAK，过一会儿内存也许腾出来了
+            spin_lock_irqsave(&display->lock, flags);
+            if (display->pending_req)
+                queue_delayed_work(display->wq, &display->alloc_work, HZ);
+            spin_unlock_irqrestore(&display->lock, flags);
+            return;
+        }
+        spin_lock_irqsave(&display->lock, flags);
+        display->buffers_ready = 1;
+        spin_unlock_irqrestore(&display->lock, flags);
+        display->alloc_failed = 0;
+        DBG("display buffers allocated, %lu KB %s\n", display->pool_pages*PAGE_SIZE/1024,
+            display_pool_names[display->pool_mode]);
+    }
+
+    spin_lock_irqsave(&display->lock, flags);
+    req = display->pending_req;
+    display->pending_req = NULL;
+    spin_unlock_irqrestore(&display->lock, flags);
+    if (!req)
+        return;
+
+    status = usb_ep_queue(display->out_ep, req, GFP_KERNEL);
+    if (status)
+    {
+        DBG("%s queue req --> %d\n", display->out_ep->name, status);
+        free_ep_req(display->out_ep, req);
+    }
+}
+
+// 断开一段时间后释放buffer，和画的工作在同一个有序的工作队列里，不会同时运行
+static void display_idle_work(struct work_struct *work)
+{
+    struct f_display *display = container_of(to_delayed_work(work), struct f_display, idle_work);
+    unsigned long flags;
+
+    spin_lock_irqsave(&display->lock, flags);
+    if (display->connected || !display->buffers_ready)
+    {
+        spin_unlock_irqrestore(&display->lock, flags);
+        return;
+    }
+    if (display->buffer_used)
+    {
+        // 断开前收到的还没画完
+        spin_unlock_irqrestore(&display->lock, flags);
+        queue_delayed_work(display->wq, &display->idle_work, HZ);
+        return;
+    }
+    display->buffers_ready = 0;
+    display->receiving = 0;
+    spin_unlock_irqrestore(&display->lock, flags);
+
+    display_buffers_free(display);
+    DBG("display buffers freed\n");
+}
+
 static void disable_display(struct f_display *display)
 {
 	struct usb_composite_dev	*cdev;
+    struct usb_request *req;
+    unsigned long flags;
 	cdev = display->function.config->cdev;
 	disable_ep(cdev, display->in_ep);
 	disable_ep(cdev, display->out_ep);
+
+    // 挂起的请求不在端点上，UDC不会帮我们释放
+    spin_lock_irqsave(&display->lock, flags);
+    req = display->stalled_req;
+    display->stalled_req = NULL;
+    display->stalled_unread = 0;
+    spin_unlock_irqrestore(&display->lock, flags);
+    if (req)
+        free_ep_req(display->out_ep, req);
+
+    spin_lock_irqsave(&display->lock, flags);
+    display->connected = 0;
+    req = display->pending_req;
+    display->pending_req = NULL;
+    spin_unlock_irqrestore(&display->lock, flags);
+    if (req)
+        free_ep_req(display->out_ep, req);
+    if (buffer_idle_s)
+        queue_delayed_work(display->wq, &display->idle_work, buffer_idle_s*HZ);
+
 	DBG_DEV(cdev, "%s disabled\n", display->function.name);
 }
 
@@ -332,6 +1169,10 @@ fail0:
 	}
 	ep->driver_data = display;
 
+    // 新的连接，主机不一定会发commit，先画前台页
+    display->receiving = 0;
+    display->session_reset = 1;
+
     req = usb_ep_alloc_request(display->out_ep, GFP_KERNEL);
     if (req) {
         req->length = USB_BULK_MAX_PACKET;
@@ -344,16 +1185,84 @@ fail0:
 
     if (req)
     {
+        unsigned long flags;
+        int ready;
+
         req->complete = display_complete;
-        result = usb_ep_queue(display->out_ep, req, GFP_KERNEL);
-        if (result)
-            DBG_DEV(cdev, "%s queue req --> %d\n", ep->name, result);
+        cancel_delayed_work(&display->idle_work);
+        spin_lock_irqsave(&display->lock, flags);
+        display->connected = 1;
+        ready = display->buffers_ready;
+        if (!ready)
+            display->pending_req = req;
+        spin_unlock_irqrestore(&display->lock, flags);
+
+        if (ready)
+        {
+            result = usb_ep_queue(display->out_ep, req, GFP_KERNEL);
+            if (result)
+                DBG_DEV(cdev, "%s queue req --> %d\n", ep->name, result);
+        }
+        else
+        {
+            queue_delayed_work(display->wq, &display->alloc_work, 0);
+        }
     }
 
 	DBG_DEV(cdev, "%s enabled\n", display->function.name);
 	return result;
 }
 
+static int display_tile_crc_reply(struct f_display *display, int first, int length);
+
+// ep0的回复都在这里排好，composite不会替function排数据阶段
+static int display_setup(struct usb_function *f, const struct usb_ctrlrequest *ctrl)
+{
+    struct f_display *display = func_to_display(f);
+    struct usb_composite_dev *cdev = f->config->cdev;
+    u16 value = le16_to_cpu(ctrl->wValue);
+    u16 length = le16_to_cpu(ctrl->wLength);
+
+    switch ((ctrl->bRequestType << 8) | ctrl->bRequest)
+    {
+    case ((USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE) << 8
+          | RPUSBDISP_CONTROL_TILE_CRC):
+        if (length % sizeof(u32) || length > USB_COMP_EP0_BUFSIZ)
+            break;
+        return display_tile_crc_reply(display, value, length);
+    case ((USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE) << 8
+          | RPUSBDISP_CONTROL_DAMAGE):
+        {
+            struct usb_request *req = cdev->req;
+            rpusbdisp_rect_t *out = req->buf;
+            unsigned long flags;
+            int i, n;
+
+            spin_lock_irqsave(&display->lock, flags);
+            n = min_t(int, display->blank_damage_count, min_t(int, length, USB_COMP_EP0_BUFSIZ)/sizeof(*out));
+            for (i=0; i<n; i++)
+            {
+                out[i].x = cpu_to_le16(display->blank_damage[i].x);
+                out[i].y = cpu_to_le16(display->blank_damage[i].y);
+                out[i].width = cpu_to_le16(display->blank_damage[i].w);
+                out[i].height = cpu_to_le16(display->blank_damage[i].h);
+            }
+            // 放不下的留到下次读
+            display->blank_damage_count -= n;
+            memmove(display->blank_damage, display->blank_damage + n,
+                    display->blank_damage_count*sizeof(display->blank_damage[0]));
+            spin_unlock_irqrestore(&display->lock, flags);
+
+            req->length = n*sizeof(*out);
+            req->zero = req->length < length;
+            return usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+        }
+    }
+
+    DBG_DEV(cdev, "unknown request 0x%x type 0x%x\n", ctrl->bRequest, ctrl->bRequestType);
+    return -EOPNOTSUPP;
+}
+
 static int display_set_alt(struct usb_function *f,
 		unsigned intf, unsigned alt)
 {
@@ -372,86 +1281,2166 @@ static void display_disable(struct usb_function *f)
 	disable_display(display);
 }
 
-static void display_do_tasklet(unsigned long data)
+// 第page页的起始地址
+static inline unsigned char __iomem *display_page_base(struct f_display *display, int page)
 {
-    struct f_display *display = (struct f_display *)data;
-    struct usb_composite_dev *cdev = display->function.config->cdev;
-    //DBG_DEV(cdev, "in tasklet irq count:%d\n", display->irq_count);
-    display->irq_count = 0;
+    return display->out.base + page*display->out.page_size;
+}
 
-    if (display->fb && (display->buffer_tail != display->buffer_head))
-    {
-        volatile struct display_buffer *cur_buffer = display->buffer_tail;
-        if (cur_buffer->cmd == RPUSBDISP_DISPCMD_BITBLT ||
-            cur_buffer->cmd == RPUSBDISP_DISPCMD_BITBLT_RLE)
-        {
-            rpusbdisp_disp_bitblt_packet_t *p = (rpusbdisp_disp_bitblt_packet_t *)cur_buffer->head;
-            unsigned int start = (p->x*display->fb->var.bits_per_pixel + p->y*display->fb->fix.line_length*8)/8;
-            unsigned char __iomem *dst = (unsigned char *)(display->fb->screen_base + start);
-            if (cur_buffer->cmd == RPUSBDISP_DISPCMD_BITBLT)
-            {
-                if (start+cur_buffer->count <= display->fb->fix.smem_len)
-                {
-                    fb_memcpy_tofb(dst, (const char *)cur_buffer->buffer, cur_buffer->count);
-                }
-                else
-                {
-                    ERR_DEV(cdev, "fb copy to large!\n");
-                }
+// 更新要画到哪一页
+static inline int display_draw_page(struct f_display *display)
+{
+    return display->flip_active ? !display->front : display->front;
+}
+
+// 主机坐标系里的区域是否在屏幕内
+static int display_rect_valid(struct f_display *display, const struct display_rect *r)
+{
+    return r->w > 0 && r->h > 0 &&
+        r->x >= 0 && r->x + r->w <= display->width &&
+        r->y >= 0 && r->y + r->h <= display->height;
+}
+
+// 主机坐标系的区域转成屏幕上的区域
+static void display_rotate_rect(struct f_display *display, struct display_rect *r)
+{
+    int w = display->out.width;
+    int h = display->out.height;
+    struct display_rect t = *r;
+
+    switch (rotate)
+    {
+    case 90:
+        r->x = w - t.y - t.h;
+        r->y = t.x;
+        r->w = t.h;
+        r->h = t.w;
+        break;
+    case 180:
+        r->x = w - t.x - t.w;
+        r->y = h - t.y - t.h;
+        break;
+    case 270:
+        r->x = t.y;
+        r->y = h - t.x - t.w;
+        r->w = t.h;
+        r->h = t.w;
+        break;
+    }
+}
+
+// 主机坐标系里w*h大小的区域，其中的点(x,y)转过以后的位置
+static void rotate_point(int w, int h, int *x, int *y)
+{
+    int t = *x;
+
+    switch (rotate)
+    {
+    case 90:
+        *x = h - 1 - *y;
+        *y = t;
+        break;
+    case 180:
+        *x = w - 1 - *x;
+        *y = h - 1 - *y;
+        break;
+    case 270:
+        *x = *y;
+        *y = w - 1 - t;
+        break;
+    }
+}
+
+// 把strip里r大小(主机坐标系)的像素转过来写到page页，stride是strip一行的像素数
+// strip只有ROTATE_STRIP_ROWS行，主机的一列在屏幕上是一小段连续的像素，
+// 读strip的一列只碰ROTATE_STRIP_ROWS条cache line，相邻的列还会用到，相当于16x16分块转置
+static void display_rotate_strip(struct f_display *display, int page, const unsigned short *strip,
+                                 int stride, const struct display_rect *r)
+{
+    unsigned int line_length = display->out.line_length;
+    unsigned char __iomem *base = display_page_base(display, page);
+    struct display_rect p = *r;
+    const unsigned short *src;
+    unsigned short *dst;
+    int i, j;
+
+    display_rotate_rect(display, &p);
+    switch (rotate)
+    {
+    case 90:
+        // 主机的第i列是屏幕的第p.y+i行，主机的行从右往左排
+        for (i=0; i<r->w; i++)
+        {
+            dst = (unsigned short *)(base + (p.y + i)*line_length) + p.x + p.w - 1;
+            for (j=0, src=strip+i; j<r->h; j++, src+=stride)
+                *dst-- = *src;
+        }
+        break;
+    case 180:
+        // 行倒过来，每行里的像素也倒过来
+        for (j=0; j<r->h; j++)
+        {
+            dst = (unsigned short *)(base + (p.y + p.h - 1 - j)*line_length) + p.x + p.w - 1;
+            for (i=0, src=strip+j*stride; i<r->w; i++)
+                *dst-- = *src++;
+        }
+        break;
+    case 270:
+        // 主机的第i列是屏幕的倒数第i行，主机的行从左往右排
+        for (i=0; i<r->w; i++)
+        {
+            dst = (unsigned short *)(base + (p.y + p.h - 1 - i)*line_length) + p.x;
+            for (j=0, src=strip+i; j<r->h; j++, src+=stride)
+                *dst++ = *src;
+        }
+        break;
+    }
+}
+
+// 把strip里攒的行写到屏幕，没写完的一行挪到strip开头接着攒
+static void blit_flush(struct display_blit *b)
+{
+    struct display_rect r = b->rect;
+
+    if (!b->strip)
+        return;
+
+    if (b->strip_rows)
+    {
+        r.h = b->strip_rows;
+        display_rotate_strip(b->display, b->page, b->strip, b->rect.w, &r);
+    }
+    if (b->col && b->rows)
+    {
+        r.y = b->rect.y + b->strip_rows;
+        r.w = b->col;
+        r.h = 1;
+        display_rotate_strip(b->display, b->page, b->strip + b->strip_rows*b->rect.w, b->rect.w, &r);
+        if (b->strip_rows)
+            memmove(b->strip, b->strip + b->strip_rows*b->rect.w, b->col*RP_DISP_BYTES_PER_PIXEL);
+    }
+    b->rect.y += b->strip_rows;
+    b->strip_rows = 0;
+    b->dst = (unsigned char __iomem *)b->strip;
+}
+
+static void blit_init(struct f_display *display, struct display_blit *b, const struct display_rect *r,
+                      unsigned short *strip)
+{
+    b->line_length = display->out.line_length;
+    b->dst = display_page_base(display, display_draw_page(display)) +
+        r->y*b->line_length + r->x*RP_DISP_BYTES_PER_PIXEL;
+    b->width = r->w;
+    b->rows = r->h;
+    b->col = 0;
+    b->strip = NULL;
+    b->scale_to = NULL;
+
+    if (rotate)
+    {
+        b->display = display;
+        b->strip = strip;
+        b->rect = *r;
+        b->strip_rows = 0;
+        b->page = display_draw_page(display);
+        b->dst = (unsigned char __iomem *)strip;
+        b->line_length = r->w*RP_DISP_BYTES_PER_PIXEL;
+        return;
+    }
+
+    // 整行宽度时内存是连续的，当成一行处理
+    if (r->x == 0 && r->w*RP_DISP_BYTES_PER_PIXEL == b->line_length)
+    {
+        b->width = r->w*r->h;
+        b->rows = 1;
+    }
+}
+
+static inline unsigned short blend565(unsigned short fg, unsigned short bg, unsigned char alpha)
+{
+    // 三个分量拆开放到32位里一起乘，alpha降到5位
+    u32 a = (alpha + 4) >> 3;
+    u32 f = (fg | (fg << 16)) & 0x07e0f81f;
+    u32 b = (bg | (bg << 16)) & 0x07e0f81f;
+    u32 r = ((((f - b) * a) >> 5) + b) & 0x07e0f81f;
+    return (unsigned short)((r >> 16) | r);
+}
+
+static void blit_scale_row(struct display_blit *b);
+
+static inline void blit_next(struct display_blit *b, unsigned int n)
+{
+    b->col += n;
+    if (b->col == b->width)
+    {
+        b->col = 0;
+        b->dst += b->line_length;
+        b->rows--;
+        if (b->strip && (++b->strip_rows == ROTATE_STRIP_ROWS || !b->rows))
+            blit_flush(b);
+        else if (b->scale_to)
+            blit_scale_row(b);
+    }
+}
+
+// 拷贝pixels个像素，超出矩形的部分丢掉
+static void blit_copy(struct display_blit *b, const unsigned char *src, unsigned int pixels)
+{
+    while (pixels && b->rows)
+    {
+        unsigned int n = min(pixels, b->width - b->col);
+        fb_memcpy_tofb(b->dst + b->col*RP_DISP_BYTES_PER_PIXEL, src, n*RP_DISP_BYTES_PER_PIXEL);
+        src += n*RP_DISP_BYTES_PER_PIXEL;
+        pixels -= n;
+        blit_next(b, n);
+    }
+}
+
+// 填充pixels个相同颜色
+static void blit_fill(struct display_blit *b, unsigned short color, unsigned int pixels)
+{
+#if RP_DISP_DEFAULT_PIXEL_BITS != 16
+#error "not support now"
+#endif
+    while (pixels && b->rows)
+    {
+        unsigned int n = min(pixels, b->width - b->col);
+        unsigned char __iomem *dst = b->dst + b->col*RP_DISP_BYTES_PER_PIXEL;
+        unsigned int i;
+        for (i=0; i<n; i++, dst+=2)
+        {
+            *(unsigned short *)dst = color;
+        }
+        pixels -= n;
+        blit_next(b, n);
+    }
+}
+
+// 源图w*h，解到b里，一行一行放大scale倍画到to
+static void blit_init_scaled(struct display_blit *b, struct display_blit *to, int w, int h,
+                             unsigned short *rows, int scale, int filter)
+{
+    b->row = rows;
+    b->prev = rows + w;
+    b->expand = rows + 2*w;
+    b->dst = (unsigned char __iomem *)b->row;
+    b->line_length = 0;
+    b->width = w;
+    b->rows = h;
+    b->col = 0;
+    b->strip = NULL;
+    b->scale_to = to;
+    b->scale = scale;
+    b->filter = filter;
+    b->row_index = 0;
+}
+
+// 把源图的行a放大成scale行，bilinear时往下一行next插值
+static void blit_scale_emit(struct display_blit *b, const unsigned short *a, const unsigned short *next)
+{
+    unsigned short *out = b->expand;
+    int w = b->width;
+    int s = b->scale;
+    int i, j, k;
+
+    if (b->filter != RPUSBDISP_SCALE_FILTER_BILINEAR)
+    {
+        // 最近邻: 横向放大一次，同一行画scale遍
+        // 2倍时写两个u16，不假设expand是4字节对齐的
+        if (s == 2)
+        {
+            for (i=0; i<w; i++, out+=2)
+            {
+                out[0] = a[i];
+                out[1] = a[i];
+            }
+        }
+        else
+        {
+            for (i=0; i<w; i++)
+                for (j=0; j<s; j++)
+                    *out++ = a[i];
+        }
+        for (k=0; k<s; k++)
+            blit_copy(b->scale_to, (const unsigned char *)b->expand, w*s);
+        return;
+    }
+
+    // 双线性: 先竖着在a和next之间插出一行，再横着在相邻两个像素之间插
+    for (k=0; k<s; k++)
+    {
+        unsigned char wy = k*256/s;
+        unsigned short left, right;
+
+        out = b->expand;
+        right = blend565(next[0], a[0], wy);
+        for (i=0; i<w; i++)
+        {
+            left = right;
+            if (i+1 < w)
+                right = blend565(next[i+1], a[i+1], wy);
+            for (j=0; j<s; j++)
+                *out++ = blend565(right, left, j*256/s);
+        }
+        blit_copy(b->scale_to, (const unsigned char *)b->expand, w*s);
+    }
+}
+
+// 源图的一行解完了
+static void blit_scale_row(struct display_blit *b)
+{
+    unsigned short *t;
+
+    if (b->filter == RPUSBDISP_SCALE_FILTER_BILINEAR)
+    {
+        // 要等下一行到了才能画上一行，最后一行和自己插值
+        if (b->row_index)
+            blit_scale_emit(b, b->prev, b->row);
+        if (!b->rows)
+            blit_scale_emit(b, b->row, b->row);
+        t = b->prev;
+        b->prev = b->row;
+        b->row = t;
+    }
+    else
+    {
+        blit_scale_emit(b, b->row, NULL);
+    }
+    b->row_index++;
+    b->dst = (unsigned char __iomem *)b->row;
+}
+
+// 分段画bitblt，每次最多解slice个像素，画完返回1
+static int display_bitblt_step(struct display_blit *b, const unsigned char *data, int count, int *offset, int slice)
+{
+    unsigned int pixels = min_t(unsigned int, (count - *offset)/RP_DISP_BYTES_PER_PIXEL, slice);
+    blit_copy(b, data + *offset, pixels);
+    *offset += pixels*RP_DISP_BYTES_PER_PIXEL;
+    return !b->rows || (count - *offset) < RP_DISP_BYTES_PER_PIXEL;
+}
+
+static int display_bitblt_rle_step(struct display_blit *b, const unsigned char *data_origin, int count, int *offset, int slice)
+{
+    const unsigned char *data = data_origin + *offset;
+    unsigned char section_head;
+    int cur_len = 0;
+    int pixels = 0;
+    while ((data-data_origin) < count && b->rows && pixels < slice)
+    {
+        section_head = data[0];
+        data++;
+        cur_len = (section_head&RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT)+1;
+        if (section_head & RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT)
+        {
+            if (data+RP_DISP_BYTES_PER_PIXEL > data_origin+count)
+                break;
+            // 段头一个字节，颜色在奇数地址上
+            blit_fill(b, get_unaligned_le16(data), cur_len);
+            data += RP_DISP_BYTES_PER_PIXEL;
+        }
+        else
+        {
+            if (data+cur_len*RP_DISP_BYTES_PER_PIXEL > data_origin+count)
+                break;
+            blit_copy(b, data, cur_len);
+            data += cur_len*RP_DISP_BYTES_PER_PIXEL;
+        }
+        pixels += cur_len;
+    }
+    *offset = data - data_origin;
+    return pixels < slice || !b->rows || *offset >= count;
+}
+
+// 分段画下标bitblt，画完返回1
+static int display_bitblt_indexed_step(struct display_blit *b, const struct display_palette *pal, int bpp,
+                                       const unsigned char *data, int count, int *offset, int slice)
+{
+    u32 chunk[INDEXED_CHUNK/2];
+    unsigned short *out = (unsigned short *)chunk;
+    int pixels = 0;
+    int n, i;
+
+    while (*offset < count && b->rows && pixels < slice)
+    {
+        const unsigned char *src = data + *offset;
+        if (bpp == 8)
+        {
+            n = min(count - *offset, INDEXED_CHUNK);
+            for (i=0; i<n; i++)
+                out[i] = pal->color[src[i]];
+            blit_copy(b, (const unsigned char *)chunk, n);
+            *offset += n;
+            pixels += n;
+        }
+        else
+        {
+            n = min(count - *offset, INDEXED_CHUNK/2);
+            for (i=0; i<n; i++)
+                chunk[i] = pal->pair[src[i]];
+            blit_copy(b, (const unsigned char *)chunk, n*2);
+            *offset += n;
+            pixels += n*2;
+        }
+    }
+    return !b->rows || *offset >= count;
+}
+
+// 和bitblt_rle一样的段，数据换成下标
+static int display_bitblt_rle_indexed_step(struct display_blit *b, const struct display_palette *pal, int bpp,
+                                           const unsigned char *data_origin, int count, int *offset, int slice)
+{
+    const unsigned char *data = data_origin + *offset;
+    u32 chunk[INDEXED_CHUNK/2];
+    unsigned short *out = (unsigned short *)chunk;
+    unsigned char section_head;
+    int cur_len, bytes, i;
+    int pixels = 0;
+
+    while ((data-data_origin) < count && b->rows && pixels < slice)
+    {
+        section_head = data[0];
+        data++;
+        cur_len = (section_head&RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT)+1;
+        if (section_head & RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT)
+        {
+            if (data+1 > data_origin+count)
+                break;
+            blit_fill(b, pal->color[bpp == 8 ? data[0] : data[0]&0x0f], cur_len);
+            data++;
+        }
+        else
+        {
+            // 一段最多128个像素，正好是一个chunk
+            bytes = bpp == 8 ? cur_len : (cur_len+1)/2;
+            if (data+bytes > data_origin+count)
+                break;
+            if (bpp == 8)
+            {
+                for (i=0; i<cur_len; i++)
+                    out[i] = pal->color[data[i]];
+            }
+            else
+            {
+                for (i=0; i<bytes; i++)
+                    chunk[i] = pal->pair[data[i]];
+            }
+            blit_copy(b, (const unsigned char *)chunk, cur_len);
+            data += bytes;
+        }
+        pixels += cur_len;
+    }
+    *offset = data - data_origin;
+    return pixels < slice || !b->rows || *offset >= count;
+}
+
+// 2D rle先把一行解到src->row里，解完整行画到b，这一行留在src->prev里给下一行参考
+static void blit_init_rows(struct display_blit *src, int w, int h, unsigned short *rows)
+{
+    src->row = rows;
+    src->prev = rows + w;
+    src->width = w;
+    src->rows = h;
+    src->col = 0;
+    // 第一行的上一行当成黑色
+    memset(src->prev, 0, w*RP_DISP_BYTES_PER_PIXEL);
+}
+
+static void rle2d_advance(struct display_blit *b, struct display_blit *src, unsigned int n)
+{
+    unsigned short *t;
+
+    src->col += n;
+    if (src->col == src->width)
+    {
+        blit_copy(b, (const unsigned char *)src->row, src->width);
+        t = src->prev;
+        src->prev = src->row;
+        src->row = t;
+        src->col = 0;
+        src->rows--;
+    }
+}
+
+static int display_bitblt_rle2d_step(struct display_blit *b, struct display_blit *src,
+                                     const unsigned char *data_origin, int count, int *offset, int slice)
+{
+    const unsigned char *data = data_origin + *offset;
+    const unsigned char *end = data_origin + count;
+    unsigned char section_head;
+    unsigned short color;
+    int cur_len, n, i;
+    int pixels = 0;
+
+    while (data < end && src->rows && pixels < slice)
+    {
+        section_head = data[0];
+        cur_len = (section_head&RPUSBDISP_RLE2D_COUNT_BIT)+1;
+
+        switch (section_head & RPUSBDISP_RLE2D_OP_MASK)
+        {
+        case RPUSBDISP_RLE2D_OP_LITERAL:
+            if (data+1+cur_len*RP_DISP_BYTES_PER_PIXEL > end)
+                goto out;
+            data++;
+            pixels += cur_len;
+            while (cur_len && src->rows)
+            {
+                n = min_t(int, cur_len, src->width - src->col);
+                memcpy(src->row + src->col, data, n*RP_DISP_BYTES_PER_PIXEL);
+                data += n*RP_DISP_BYTES_PER_PIXEL;
+                cur_len -= n;
+                rle2d_advance(b, src, n);
+            }
+            break;
+        case RPUSBDISP_RLE2D_OP_RUN:
+            if (data+1+RP_DISP_BYTES_PER_PIXEL > end)
+                goto out;
+            color = get_unaligned_le16(data+1);
+            data += 1+RP_DISP_BYTES_PER_PIXEL;
+            pixels += cur_len;
+            while (cur_len && src->rows)
+            {
+                n = min_t(int, cur_len, src->width - src->col);
+                for (i=0; i<n; i++)
+                    src->row[src->col+i] = color;
+                cur_len -= n;
+                rle2d_advance(b, src, n);
+            }
+            break;
+        case RPUSBDISP_RLE2D_OP_ABOVE:
+            data++;
+            pixels += cur_len;
+            while (cur_len && src->rows)
+            {
+                n = min_t(int, cur_len, src->width - src->col);
+                memcpy(src->row + src->col, src->prev + src->col, n*RP_DISP_BYTES_PER_PIXEL);
+                cur_len -= n;
+                rle2d_advance(b, src, n);
+            }
+            break;
+        default:
+            data++;
+            n = src->width - src->col;
+            memcpy(src->row + src->col, src->prev + src->col, n*RP_DISP_BYTES_PER_PIXEL);
+            rle2d_advance(b, src, n);
+            pixels += n;
+            // 整行重复的直接从prev画，不用再拷
+            for (i=1; i<cur_len && src->rows; i++)
+            {
+                blit_copy(b, (const unsigned char *)src->prev, src->width);
+                src->rows--;
+                pixels += src->width;
+            }
+            break;
+        }
+    }
+out:
+    *offset = data - data_origin;
+    return pixels < slice || !src->rows || *offset >= count;
+}
+
+// YUV转RGB的系数，放大了256倍，Y的系数都是298
+struct yuv_matrix
+{
+    int rv;
+    int gu;
+    int gv;
+    int bu;
+};
+
+static const struct yuv_matrix yuv_matrix[] = {
+    [RPUSBDISP_YUV_MATRIX_BT601] = { 409, 100, 208, 516 },
+    [RPUSBDISP_YUV_MATRIX_BT709] = { 459, 55, 136, 541 },
+};
+
+static inline unsigned short yuv_pixel(int c, int r, int g, int b)
+{
+    r = clamp((c + r) >> 8, 0, 255);
+    g = clamp((c + g) >> 8, 0, 255);
+    b = clamp((c + b) >> 8, 0, 255);
+    return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+}
+
+// 转换一行里的n个像素，两个像素共用一组UV，step是相邻两个U之间的距离(I420是1，NV12是2)
+static void yuv_convert(u32 *out, const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                        int step, int n, const struct yuv_matrix *m)
+{
+    int i, d, e, r, g, b;
+
+    // 只有整数乘加，没有分支依赖，编译器可以自动向量化
+    for (i=0; i+1<n; i+=2, u+=step, v+=step)
+    {
+        d = *u - 128;
+        e = *v - 128;
+        r = m->rv*e;
+        g = -m->gu*d - m->gv*e;
+        b = m->bu*d;
+        out[i/2] = yuv_pixel(298*(y[i] - 16) + 128, r, g, b) |
+            ((u32)yuv_pixel(298*(y[i+1] - 16) + 128, r, g, b) << 16);
+    }
+    if (i < n)
+    {
+        d = *u - 128;
+        e = *v - 128;
+        ((unsigned short *)out)[i] = yuv_pixel(298*(y[i] - 16) + 128, m->rv*e, -m->gu*d - m->gv*e, m->bu*d);
+    }
+}
+
+// 分段画yuv bitblt，offset是画到的行，画完返回1
+static int display_bitblt_yuv_step(struct display_blit *b, const rpusbdisp_disp_bitblt_yuv_packet_t *p,
+                                   const unsigned char *data, int *offset, int slice)
+{
+    int w = le16_to_cpu(p->width);
+    int h = le16_to_cpu(p->height);
+    int cw = (w + 1)/2;
+    int ch = (h + 1)/2;
+    const struct yuv_matrix *m = &yuv_matrix[p->matrix];
+    const unsigned char *u, *v;
+    u32 chunk[YUV_CHUNK/2];
+    int step, col, n;
+    int pixels = 0;
+
+    if (p->format == RPUSBDISP_YUV_FORMAT_NV12)
+    {
+        u = data + w*h;
+        v = u + 1;
+        step = 2;
+    }
+    else
+    {
+        u = data + w*h;
+        v = u + cw*ch;
+        step = 1;
+    }
+
+    while (*offset < h && b->rows && pixels < slice)
+    {
+        const unsigned char *y = data + *offset*w;
+        int crow = (*offset/2)*cw;
+
+        for (col=0; col<w; col+=n)
+        {
+            n = min(w - col, YUV_CHUNK);
+            yuv_convert(chunk, y + col, u + (crow + col/2)*step, v + (crow + col/2)*step, step, n, m);
+            blit_copy(b, (const unsigned char *)chunk, n);
+        }
+        (*offset)++;
+        pixels += w;
+    }
+    return !b->rows || *offset >= h;
+}
+
+static inline int rect_area(const struct display_rect *r)
+{
+    return r->w*r->h;
+}
+
+// a是否完全盖住b
+static inline int rect_contains(const struct display_rect *a, const struct display_rect *b)
+{
+    return b->x >= a->x && b->y >= a->y &&
+        b->x + b->w <= a->x + a->w && b->y + b->h <= a->y + a->h;
+}
+
+static void rect_union(struct display_rect *d, const struct display_rect *a, const struct display_rect *b)
+{
+    int x = min(a->x, b->x);
+    int y = min(a->y, b->y);
+    d->w = max(a->x + a->w, b->x + b->w) - x;
+    d->h = max(a->y + a->h, b->y + b->h) - y;
+    d->x = x;
+    d->y = y;
+}
+
+// d = a和b的交集，没有交集返回0
+static int rect_intersect(struct display_rect *d, const struct display_rect *a, const struct display_rect *b)
+{
+    int x = max(a->x, b->x);
+    int y = max(a->y, b->y);
+    int w = min(a->x + a->w, b->x + b->w) - x;
+    int h = min(a->y + a->h, b->y + b->h) - y;
+    if (w <= 0 || h <= 0)
+        return 0;
+    d->x = x;
+    d->y = y;
+    d->w = w;
+    d->h = h;
+    return 1;
+}
+
+static int rect_intersect_area(const struct display_rect *a, const struct display_rect *b)
+{
+    struct display_rect d;
+    return rect_intersect(&d, a, b) ? rect_area(&d) : 0;
+}
+
+// 两个区域合并成外接矩形后多出来的面积，0表示可以无损合并(包含，或者相邻且等宽/等高)
+static int rect_merge_cost(const struct display_rect *a, const struct display_rect *b)
+{
+    struct display_rect u;
+    rect_union(&u, a, b);
+    return rect_area(&u) - rect_area(a) - rect_area(b) + rect_intersect_area(a, b);
+}
+
+// 把r加到最多DAMAGE_MAX个的区域列表里
+static void rect_list_add(struct display_rect *list, int *count, const struct display_rect *r)
+{
+    struct display_rect cur = *r;
+    int i, cost, best, best_cost;
+
+    // 能无损合并的一直合并下去，合并后的区域可能又和别的相邻
+again:
+    for (i=0; i<*count; i++)
+    {
+        if (rect_merge_cost(&list[i], &cur) == 0)
+        {
+            rect_union(&cur, &cur, &list[i]);
+            list[i] = list[--*count];
+            goto again;
+        }
+    }
+
+    if (*count < DAMAGE_MAX)
+    {
+        list[(*count)++] = cur;
+        return;
+    }
+
+    // 满了就并到多拷贝面积最少的那个
+    best = 0;
+    best_cost = rect_merge_cost(&list[0], &cur);
+    for (i=1; i<DAMAGE_MAX; i++)
+    {
+        cost = rect_merge_cost(&list[i], &cur);
+        if (cost < best_cost)
+        {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    rect_union(&list[best], &list[best], &cur);
+}
+
+// 记录当前帧的更新区域，commit以后要同步到另一页
+static void display_damage_add(struct f_display *display, const struct display_rect *r)
+{
+    rect_list_add(display->damage, &display->damage_count, r);
+}
+
+// 记录前台页上改过的区域，输出后端要主动刷新时攒起来一起提交
+static void display_flush_add(struct f_display *display, const struct display_rect *r)
+{
+    if (display->out.ops->flush)
+        rect_list_add(display->flush, &display->flush_count, r);
+}
+
+// 等输出后端加速的操作做完，CPU读写像素之前调用
+static void display_sync(struct f_display *display)
+{
+    if (!display->accel_pending)
+        return;
+    display->accel_pending = 0;
+    if (display->out.ops->sync)
+        display->out.ops->sync(&display->out);
+}
+
+static void display_flush(struct f_display *display)
+{
+    if (!display->flush_count)
+        return;
+    display_sync(display);
+    display->out.ops->flush(&display->out, display->front, display->flush, display->flush_count);
+    display->flush_count = 0;
+    display->flush_last = ktime_get();
+}
+
+// 填充page页上的区域，后端不能加速的用CPU画
+static void display_fill_rect(struct f_display *display, int page, const struct display_rect *r,
+                              unsigned short color, int operation)
+{
+    unsigned int line_length = display->out.line_length;
+    unsigned char __iomem *dst;
+    int i, j;
+
+    if (display->out.ops->fill &&
+        !display->out.ops->fill(&display->out, page, r, color, operation))
+    {
+        display->accel_pending = 1;
+        return;
+    }
+
+    display_sync(display);
+    dst = display_page_base(display, page) + r->y*line_length + r->x*RP_DISP_BYTES_PER_PIXEL;
+    for (i=0; i<r->h; i++, dst+=line_length)
+    {
+        unsigned short *pixel = (unsigned short *)dst;
+        switch (operation)
+        {
+        case RPUSBDISP_OPERATION_XOR:
+            for (j=0; j<r->w; j++)
+                pixel[j] ^= color;
+            break;
+        case RPUSBDISP_OPERATION_OR:
+            for (j=0; j<r->w; j++)
+                pixel[j] |= color;
+            break;
+        case RPUSBDISP_OPERATION_AND:
+            for (j=0; j<r->w; j++)
+                pixel[j] &= color;
+            break;
+        default:
+            for (j=0; j<r->w; j++)
+                pixel[j] = color;
+            break;
+        }
+    }
+}
+
+// 把src_page页上的区域拷到dst_page页的(dx,dy)，同一页上可以重叠
+static void display_copy_area(struct f_display *display, int src_page, const struct display_rect *r,
+                              int dst_page, int dx, int dy)
+{
+    int line_length = display->out.line_length;
+    unsigned int size = r->w*RP_DISP_BYTES_PER_PIXEL;
+    unsigned char __iomem *src;
+    unsigned char __iomem *dst;
+    int i;
+
+    if (display->out.ops->copy &&
+        !display->out.ops->copy(&display->out, src_page, r, dst_page, dx, dy))
+    {
+        display->accel_pending = 1;
+        return;
+    }
+
+    display_sync(display);
+    src = display_page_base(display, src_page) + r->y*line_length + r->x*RP_DISP_BYTES_PER_PIXEL;
+    dst = display_page_base(display, dst_page) + dy*line_length + dx*RP_DISP_BYTES_PER_PIXEL;
+    if (src_page != dst_page)
+    {
+        for (i=0; i<r->h; i++, src+=line_length, dst+=line_length)
+            fb_memcpy_tofb(dst, src, size);
+        return;
+    }
+
+    // 往下拷从最后一行开始，不会先把还没拷的源盖掉
+    if (dy > r->y)
+    {
+        src += (r->h-1)*line_length;
+        dst += (r->h-1)*line_length;
+        line_length = -line_length;
+    }
+    for (i=0; i<r->h; i++, src+=line_length, dst+=line_length)
+        memmove(dst, src, size);
+}
+
+// 把一个区域从src页拷贝到dst页
+static void display_copy_rect(struct f_display *display, const struct display_rect *r, int src_page, int dst_page)
+{
+    display_copy_area(display, src_page, r, dst_page, r->x, r->y);
+}
+
+// 光标在屏幕上的区域(裁剪过的)，不显示返回0
+static int display_cursor_rect(struct f_display *display, struct display_rect *r)
+{
+    struct display_cursor *c = &display->cursor;
+    struct display_rect screen = {0, 0, display->out.width, display->out.height};
+    struct display_rect sprite = {c->x - c->hot_x, c->y - c->hot_y, c->width, c->height};
+
+    if (!c->visible || !c->width || !c->height)
+        return 0;
+    return rect_intersect(r, &sprite, &screen);
+}
+
+// 擦掉page页上的光标，恢复被盖住的内容
+static void display_cursor_hide(struct f_display *display, int page)
+{
+    struct display_cursor *c = &display->cursor;
+    struct display_rect *r = &c->rect[page];
+    unsigned int line_length = display->out.line_length;
+    const unsigned short *src = c->save[page];
+    unsigned char __iomem *dst;
+    int i;
+
+    if (!c->drawn[page])
+        return;
+
+    display_sync(display);
+    dst = display_page_base(display, page) + r->y*line_length + r->x*RP_DISP_BYTES_PER_PIXEL;
+    for (i=0; i<r->h; i++, dst+=line_length, src+=r->w)
+        fb_memcpy_tofb(dst, src, r->w*RP_DISP_BYTES_PER_PIXEL);
+    c->drawn[page] = 0;
+    if (page == display->front)
+        display_flush_add(display, r);
+}
+
+// 在page页上画光标，先保存被盖住的内容
+static void display_cursor_show(struct f_display *display, int page)
+{
+    struct display_cursor *c = &display->cursor;
+    struct display_rect *r = &c->rect[page];
+    unsigned int line_length = display->out.line_length;
+    unsigned short *save = c->save[page];
+    unsigned char __iomem *dst;
+    int sx, sy, i, j;
+
+    if (c->drawn[page] || !display_cursor_rect(display, r))
+        return;
+
+    display_sync(display);
+    // 裁剪后在光标图像里的起点
+    sx = r->x - (c->x - c->hot_x);
+    sy = r->y - (c->y - c->hot_y);
+    dst = display_page_base(display, page) + r->y*line_length + r->x*RP_DISP_BYTES_PER_PIXEL;
+    for (i=0; i<r->h; i++, dst+=line_length, save+=r->w)
+    {
+        const unsigned short *image = c->image + (sy+i)*c->width + sx;
+        const unsigned char *alpha = c->alpha + (sy+i)*c->width + sx;
+
+        fb_memcpy_fromfb(save, dst, r->w*RP_DISP_BYTES_PER_PIXEL);
+        for (j=0; j<r->w; j++)
+        {
+            if (!alpha[j])
+                continue;
+            *(unsigned short *)(dst + j*RP_DISP_BYTES_PER_PIXEL) =
+                alpha[j] == 0xff ? image[j] : blend565(image[j], save[j], alpha[j]);
+        }
+    }
+    c->drawn[page] = 1;
+    if (page == display->front)
+        display_flush_add(display, r);
+}
+
+// 从src页拷贝了内容到dst页以后，把拷过去的光标换回src页光标下面的内容
+static void display_cursor_patch(struct f_display *display, int src_page, int dst_page)
+{
+    struct display_cursor *c = &display->cursor;
+    struct display_rect *r = &c->rect[src_page];
+    unsigned int line_length = display->out.line_length;
+    const unsigned short *src = c->save[src_page];
+    unsigned char __iomem *dst;
+    int i;
+
+    if (!c->drawn[src_page])
+        return;
+
+    display_sync(display);
+    dst = display_page_base(display, dst_page) + r->y*line_length + r->x*RP_DISP_BYTES_PER_PIXEL;
+    for (i=0; i<r->h; i++, dst+=line_length, src+=r->w)
+        fb_memcpy_tofb(dst, src, r->w*RP_DISP_BYTES_PER_PIXEL);
+}
+
+// 主机移动了光标
+static void display_cursor_update(struct f_display *display)
+{
+    struct display_cursor *c = &display->cursor;
+    unsigned long flags;
+    int dirty;
+
+    spin_lock_irqsave(&display->lock, flags);
+    dirty = display->cursor_dirty;
+    display->cursor_dirty = 0;
+    if (dirty)
+    {
+        c->x = display->cursor_x;
+        c->y = display->cursor_y;
+        c->visible = display->cursor_visible;
+    }
+    spin_unlock_irqrestore(&display->lock, flags);
+    if (dirty)
+        rotate_point(display->width, display->height, &c->x, &c->y);
+
+    if (!dirty)
+        return;
+
+    display_cursor_hide(display, display->front);
+    display_cursor_show(display, display->front);
+}
+
+// 主机上传新的光标图像
+static void display_cursor_image(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    struct display_cursor *c = &display->cursor;
+    rpusbdisp_disp_cursor_image_packet_t *p = (rpusbdisp_disp_cursor_image_packet_t *)cur_buffer->head;
+    int width = le16_to_cpu(p->width);
+    int height = le16_to_cpu(p->height);
+    int pixels = width*height;
+    const unsigned short *image = (const unsigned short *)cur_buffer->buffer;
+    const unsigned char *alpha = cur_buffer->buffer + pixels*RP_DISP_BYTES_PER_PIXEL;
+    int i, j, x, y;
+
+    if (width > RPUSBDISP_CURSOR_MAX_SIZE || height > RPUSBDISP_CURSOR_MAX_SIZE ||
+        cur_buffer->count < pixels*(RP_DISP_BYTES_PER_PIXEL+1))
+    {
+        ERR_DEV(cdev, "bad cursor image %dx%d count:%d\n", width, height, cur_buffer->count);
+        return;
+    }
+
+    display_cursor_hide(display, display->front);
+    c->width = width;
+    c->height = height;
+    c->hot_x = le16_to_cpu(p->hot_x);
+    c->hot_y = le16_to_cpu(p->hot_y);
+    if (!rotate)
+    {
+        memcpy(c->image, image, pixels*RP_DISP_BYTES_PER_PIXEL);
+        memcpy(c->alpha, alpha, pixels);
+    }
+    else
+    {
+        // 光标图像和热点按屏幕的方向存
+        if (rotate != 180)
+        {
+            c->width = height;
+            c->height = width;
+        }
+        rotate_point(width, height, &c->hot_x, &c->hot_y);
+        for (j=0; j<height; j++)
+        {
+            for (i=0; i<width; i++)
+            {
+                x = i;
+                y = j;
+                rotate_point(width, height, &x, &y);
+                c->image[y*c->width + x] = image[j*width + i];
+                c->alpha[y*c->width + x] = alpha[j*width + i];
+            }
+        }
+    }
+    display_cursor_show(display, display->front);
+}
+
+static int display_pan(struct f_display *display, int page)
+{
+    display_sync(display);
+    return display->out.ops->pan(&display->out, page);
+}
+
+static void display_vsync_init(struct f_display *display)
+{
+    display->vsync_period = ns_to_ktime(display->out.frame_ns);
+    display->vsync_last = ktime_get();
+    display->hw_vsync = display->out.ops->wait_vsync != NULL;
+}
+
+// 睡到t时刻
+static void display_sleep_until(ktime_t t)
+{
+    if (ktime_us_delta(t, ktime_get()) <= 0)
+        return;
+    set_current_state(TASK_UNINTERRUPTIBLE);
+    schedule_hrtimeout_range(&t, 100*NSEC_PER_USEC, HRTIMER_MODE_ABS);
+}
+
+// 等下一个vblank，输出后端支持时用控制器的vblank中断，
+// 否则只能按刷新周期节拍，相位对不上vblank
+static void display_wait_vsync(struct f_display *display)
+{
+    ktime_t next;
+    int ret;
+
+    if (display->hw_vsync)
+    {
+        ret = display->out.ops->wait_vsync(&display->out);
+        if (!ret)
+        {
+            display->vsync_last = ktime_get();
+            return;
+        }
+        ERR("%s can't wait vsync(%d), pace by refresh period\n", display->out.name, ret);
+        display->hw_vsync = 0;
+    }
+
+    next = ktime_add(display->vsync_last, display->vsync_period);
+    if (ktime_us_delta(next, ktime_get()) < 0)
+    {
+        // 空闲了一段时间，从现在开始重新计
+        display->vsync_last = ktime_get();
+        return;
+    }
+    display_sleep_until(next);
+    display->vsync_last = next;
+}
+
+// 主机时间戳换算成本地时间。第一次以当前时间加present_delay_ms为基准，
+// 之后按时间戳的差值推算，差得太远说明主机时钟跳了，重新对时
+static ktime_t display_present_time(struct f_display *display, u32 ts)
+{
+    ktime_t now = ktime_get();
+    ktime_t t;
+    s32 delta;
+    s64 diff;
+
+    if (display->present_synced)
+    {
+        delta = (s32)(ts - display->present_base_ts);
+        if (delta >= 0)
+            t = ktime_add_us(display->present_base, delta);
+        else
+            t = ktime_sub_us(display->present_base, -(s64)delta);
+
+        diff = ktime_us_delta(t, now);
+        if (diff <= PRESENT_MAX_US && diff >= -PRESENT_MAX_US)
+            return t;
+    }
+
+    display->present_synced = 1;
+    display->present_base_ts = ts;
+    display->present_base = ktime_add_us(now, present_delay_ms*USEC_PER_MSEC);
+    return display->present_base;
+}
+
+static void display_present(struct f_display *display, const rpusbdisp_disp_present_packet_t *p)
+{
+    ktime_t t = display_present_time(display, le32_to_cpu(p->timestamp_us));
+
+    if (display->flip_active)
+    {
+        // 后面的更新先画到后台页，等commit时再按时间翻页
+        display->present_time = t;
+        display->present_pending = 1;
+        return;
+    }
+
+    // 单缓冲: 上一帧先提交出去，到点后从vblank开始画这一帧
+    display_flush(display);
+    display_sleep_until(t);
+    display_wait_vsync(display);
+}
+
+// 主机提交一帧: 翻到后台页，再把这一帧的更新同步到新的后台页
+static void display_commit(struct f_display *display)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    int back = !display->front;
+    int i;
+
+    if (!display->flip_capable)
+        return;
+
+    if (!display->flip_active)
+    {
+        // 第一个commit之前的更新都画在前台页，整页同步过去
+        struct display_rect all = {0, 0, display->out.width, display->out.height};
+        display_copy_rect(display, &all, display->front, back);
+        display_cursor_patch(display, display->front, back);
+        display->flip_active = 1;
+        display->damage_count = 0;
+        return;
+    }
+
+    if (display->present_pending)
+    {
+        display->present_pending = 0;
+        display_sleep_until(display->present_time);
+    }
+
+    if (!display->damage_count)
+        return;
+
+    // 光标也要画到新的一页上
+    display_flush(display);
+    display_cursor_show(display, back);
+    if (display_pan(display, back))
+    {
+        // 翻页失败，把后台页的更新拷到前台，退回单缓冲
+        ERR_DEV(cdev, "pan display fail, disable page flip\n");
+        display_cursor_hide(display, back);
+        display_cursor_hide(display, display->front);
+        for (i=0; i<display->damage_count; i++)
+        {
+            display_copy_rect(display, &display->damage[i], back, display->front);
+            display_flush_add(display, &display->damage[i]);
+        }
+        display_cursor_show(display, display->front);
+        display->flip_capable = 0;
+        display->flip_active = 0;
+        display->damage_count = 0;
+        return;
+    }
+
+    // 等翻页生效，旧的前台页扫描完才能往里写
+    display->front = back;
+    display_wait_vsync(display);
+    // 后台页保持没有光标
+    display_cursor_hide(display, !display->front);
+    for (i=0; i<display->damage_count; i++)
+        display_copy_rect(display, &display->damage[i], display->front, !display->front);
+    display_cursor_patch(display, display->front, !display->front);
+    display->damage_count = 0;
+}
+
+// fillrect包的right/bottom是包含在内的
+static void display_fillrect_rect(const rpusbdisp_disp_fillrect_packet_t *p, struct display_rect *r)
+{
+    r->x = le16_to_cpu(p->left);
+    r->y = le16_to_cpu(p->top);
+    r->w = (int)le16_to_cpu(p->right) - r->x + 1;
+    r->h = (int)le16_to_cpu(p->bottom) - r->y + 1;
+}
+
+static void display_copyarea_rect(const rpusbdisp_disp_copyarea_packet_t *p, struct display_rect *src, struct display_rect *dst)
+{
+    src->x = le16_to_cpu(p->sx);
+    src->y = le16_to_cpu(p->sy);
+    dst->x = le16_to_cpu(p->dx);
+    dst->y = le16_to_cpu(p->dy);
+    src->w = dst->w = le16_to_cpu(p->width);
+    src->h = dst->h = le16_to_cpu(p->height);
+}
+
+static struct display_tile *display_tile_find(struct f_display *display, u32 id)
+{
+    struct display_tile *tile;
+
+    hlist_for_each_entry(tile, &display->tiles.hash[hash_32(id, TILE_HASH_BITS)], node)
+    {
+        if (tile->id == id)
+            return tile;
+    }
+    return NULL;
+}
+
+static void display_tile_free(struct f_display *display, struct display_tile *tile)
+{
+    hlist_del(&tile->node);
+    list_del(&tile->lru);
+    display->tiles.bytes -= sizeof(*tile) + tile->width*tile->height*RP_DISP_BYTES_PER_PIXEL;
+    kfree(tile);
+}
+
+static void display_tile_init(struct f_display *display)
+{
+    int i;
+
+    for (i=0; i<ARRAY_SIZE(display->tiles.hash); i++)
+        INIT_HLIST_HEAD(&display->tiles.hash[i]);
+    INIT_LIST_HEAD(&display->tiles.lru);
+}
+
+static void display_tile_clear(struct f_display *display)
+{
+    struct display_tile *tile, *n;
+
+    list_for_each_entry_safe(tile, n, &display->tiles.lru, lru)
+        display_tile_free(display, tile);
+}
+
+// 存一个图块，id已经有了就替换掉
+static void display_tile_store(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    struct display_tile_cache *cache = &display->tiles;
+    rpusbdisp_disp_tile_store_packet_t *p = (rpusbdisp_disp_tile_store_packet_t *)cur_buffer->head;
+    struct display_tile *tile;
+    u32 id = le32_to_cpu(p->id);
+    int w = le16_to_cpu(p->width);
+    int h = le16_to_cpu(p->height);
+    unsigned int size;
+
+    // 先分别检查宽高，65535x65535相乘会溢出
+    if (!w || !h || w > RPUSBDISP_TILE_MAX_PIXELS || h > RPUSBDISP_TILE_MAX_PIXELS ||
+        w*h > RPUSBDISP_TILE_MAX_PIXELS || cur_buffer->count < w*h*RP_DISP_BYTES_PER_PIXEL)
+    {
+        ERR_DEV(cdev, "bad tile %u %dx%d size:%d\n", id, w, h, cur_buffer->count);
+        return;
+    }
+    size = sizeof(*tile) + w*h*RP_DISP_BYTES_PER_PIXEL;
+
+    tile = display_tile_find(display, id);
+    if (tile)
+        display_tile_free(display, tile);
+
+    while (cache->bytes + size > tile_cache_kb*1024 && !list_empty(&cache->lru))
+    {
+        display_tile_free(display, list_last_entry(&cache->lru, struct display_tile, lru));
+        cache->evictions++;
+    }
+
+    tile = kmalloc(size, GFP_KERNEL);
+    if (!tile)
+    {
+        ERR_DEV(cdev, "no memory for tile %u\n", id);
+        return;
+    }
+    tile->id = id;
+    tile->width = w;
+    tile->height = h;
+    memcpy(tile->pixels, cur_buffer->buffer, w*h*RP_DISP_BYTES_PER_PIXEL);
+    hlist_add_head(&tile->node, &cache->hash[hash_32(id, TILE_HASH_BITS)]);
+    list_add(&tile->lru, &cache->lru);
+    cache->bytes += size;
+}
+
+// 画屏幕的命令返回1，取出影响的区域和UPDATE_xxx属性
+static int display_buffer_rect(struct f_display *display, volatile struct display_buffer *buf, struct display_rect *r, int *flags)
+{
+    int operation;
+
+    switch (buf->cmd)
+    {
+    case RPUSBDISP_DISPCMD_BITBLT:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE:
+    case RPUSBDISP_DISPCMD_BITBLT_LZ4:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE2D:
+    case RPUSBDISP_DISPCMD_BITBLT_INDEXED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_INDEXED:
+    case RPUSBDISP_DISPCMD_BITBLT_YUV420:
+        {
+            // 下标和yuv bitblt的包头前面和bitblt一样
+            rpusbdisp_disp_bitblt_packet_t *p = (rpusbdisp_disp_bitblt_packet_t *)buf->head;
+            r->x = le16_to_cpu(p->x);
+            r->y = le16_to_cpu(p->y);
+            r->w = le16_to_cpu(p->width);
+            r->h = le16_to_cpu(p->height);
+            operation = p->operation;
+        }
+        break;
+    case RPUSBDISP_DISPCMD_BITBLT_SCALED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED:
+        {
+            rpusbdisp_disp_bitblt_scaled_packet_t *p = (rpusbdisp_disp_bitblt_scaled_packet_t *)buf->head;
+            r->x = le16_to_cpu(p->x);
+            r->y = le16_to_cpu(p->y);
+            r->w = le16_to_cpu(p->width)*p->scale;
+            r->h = le16_to_cpu(p->height)*p->scale;
+            operation = p->operation;
+        }
+        break;
+    case RPUSBDISP_DISPCMD_FILL:
+        r->x = 0;
+        r->y = 0;
+        r->w = display->width;
+        r->h = display->height;
+        operation = RPUSBDISP_OPERATION_COPY;
+        break;
+    case RPUSBDISP_DISPCMD_RECT:
+        {
+            rpusbdisp_disp_fillrect_packet_t *p = (rpusbdisp_disp_fillrect_packet_t *)buf->head;
+            display_fillrect_rect(p, r);
+            operation = p->operation;
+        }
+        break;
+    case RPUSBDISP_DISPCMD_TILE_DRAW:
+        {
+            // 没有缓存的图块什么也不画，也不能当成更新区域
+            rpusbdisp_disp_tile_draw_packet_t *p = (rpusbdisp_disp_tile_draw_packet_t *)buf->head;
+            struct display_tile *tile = display_tile_find(display, le32_to_cpu(p->id));
+            if (!tile)
+                return 0;
+            r->x = le16_to_cpu(p->x);
+            r->y = le16_to_cpu(p->y);
+            r->w = tile->width;
+            r->h = tile->height;
+            operation = p->operation;
+        }
+        break;
+    case RPUSBDISP_DISPCMD_COPY_AREA:
+        {
+            // 源和目标都算在内
+            struct display_rect src, dst;
+            display_copyarea_rect((rpusbdisp_disp_copyarea_packet_t *)buf->head, &src, &dst);
+            rect_union(r, &src, &dst);
+            *flags = UPDATE_READ;
+        }
+        return 1;
+    default:
+        return 0;
+    }
+
+    *flags = 0;
+    if ((operation&RPUSBDISP_OPERATION_MASK) == RPUSBDISP_OPERATION_COPY)
+        *flags |= UPDATE_OPAQUE;
+    if (operation & RPUSBDISP_OPERATION_FLAG_URGENT)
+        *flags |= UPDATE_URGENT;
+    return 1;
+}
+
+// 往后看已经收完的buffer，被后面不透明的更新完全盖住的不用画了
+// commit/present等其它命令是帧的边界，要读屏幕的copy area也依赖前面的结果，都不能跨过去
+static int display_buffer_superseded(struct f_display *display, volatile struct display_buffer *cur_buffer)
+{
+    volatile struct display_buffer *p = cur_buffer;
+    struct display_rect r, later;
+    int flags;
+    int n;
+
+    // 只看cur_buffer后面已经收完的，插队的cur_buffer后面可能就是buffer_head
+    n = display->buffer_used - 1 -
+        (cur_buffer - display->buffer_tail + BUFFER_COUNT) % BUFFER_COUNT;
+    if (!display_buffer_rect(display, cur_buffer, &r, &flags))
+        return 0;
+
+    while (n-- > 0)
+    {
+        circular_buffer_incr(display, &p);
+        if (!display_buffer_rect(display, p, &later, &flags) || (flags & UPDATE_READ))
+            return 0;
+        if ((flags & UPDATE_OPAQUE) &&
+            display_rect_valid(display, &later) &&
+            rect_contains(&later, &r))
+            return 1;
+    }
+    return 0;
+}
+
+static inline int display_buffer_urgent(const struct display_rect *r, int flags)
+{
+    return (flags & UPDATE_URGENT) || rect_area(r) <= urgent_pixels;
+}
+
+// 在until前面还没画完的更新和r重叠，或者有帧边界，就不能插队
+static int display_buffer_blocked(struct f_display *display, volatile struct display_buffer *until, const struct display_rect *r)
+{
+    volatile struct display_buffer *p = display->buffer_tail;
+    struct display_rect earlier;
+    int flags;
+
+    for (; p != until; circular_buffer_incr(display, &p))
+    {
+        if (p->done)
+            continue;
+        if (!display_buffer_rect(display, p, &earlier, &flags) || rect_intersect_area(&earlier, r))
+            return 1;
+    }
+    return 0;
+}
+
+// 空闲的行缓冲份数
+static int display_scratch_free(struct f_display *display)
+{
+    int i, n = 0;
+
+    for (i=0; i<SCRATCH_COUNT; i++)
+        n += !display->scratch[i].used;
+    return n;
+}
+
+// 开始画时拿一份行缓冲，display_buffer_next保证有空的
+static void display_scratch_get(struct f_display *display, struct display_buffer *buf)
+{
+    int i;
+
+    for (i=0; i<SCRATCH_COUNT && !buf->scratch; i++)
+    {
+        if (!display->scratch[i].used)
+        {
+            display->scratch[i].used = 1;
+            buf->scratch = &display->scratch[i];
+        }
+    }
+}
+
+// 画完(或者不用画了)马上还，插队画完的buffer还要等前面的画完才释放
+static void display_scratch_put(struct f_display *display, struct display_buffer *buf)
+{
+    if (display->lz4_owner == buf)
+        display->lz4_owner = NULL;
+    if (buf->scratch)
+    {
+        buf->scratch->used = 0;
+        buf->scratch = NULL;
+    }
+}
+
+// 选下一个要画的buffer: 默认按顺序，加急的更新可以插到前面去，
+// 但不能越过和它重叠的更新，也不能越过commit等帧边界
+static struct display_buffer *display_buffer_next(struct f_display *display)
+{
+    volatile struct display_buffer *p = display->buffer_tail;
+    struct display_buffer *first = NULL;
+    struct display_rect r;
+    int flags;
+    int n;
+
+    for (n = display->buffer_used; n > 0; n--, circular_buffer_incr(display, &p))
+    {
+        if (p->done)
+            continue;
+
+        if (!display_buffer_rect(display, p, &r, &flags))
+            return first ? first : (struct display_buffer *)p;
+
+        // lz4解压缓冲被插队的更新占着，先把它画完
+        if (p->cmd == RPUSBDISP_DISPCMD_BITBLT_LZ4 && display->lz4_owner && display->lz4_owner != p)
+        {
+            if (!first)
+                return display->lz4_owner;
+            continue;
+        }
+
+        if (!first)
+        {
+            first = (struct display_buffer *)p;
+            if (display_buffer_urgent(&r, flags))
+                return first;
+        }
+        // 插队的要拿得到行缓冲，还要给first留一份
+        else if (display_buffer_urgent(&r, flags) && !display_buffer_blocked(display, p, &r) &&
+                 (p->scratch || display_scratch_free(display) > !first->scratch))
+        {
+            return (struct display_buffer *)p;
+        }
+    }
+    return first;
+}
+
+// fill/rect/copy area，交给输出后端加速
+static void display_do_accel(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    int page = display_draw_page(display);
+    struct display_rect r, src;
+
+    if (cur_buffer->cmd == RPUSBDISP_DISPCMD_FILL)
+    {
+        rpusbdisp_disp_fill_packet_t *p = (rpusbdisp_disp_fill_packet_t *)cur_buffer->head;
+        r.x = 0;
+        r.y = 0;
+        r.w = display->out.width;
+        r.h = display->out.height;
+        display_fill_rect(display, page, &r, le16_to_cpu(p->color_565), RPUSBDISP_OPERATION_COPY);
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_RECT)
+    {
+        rpusbdisp_disp_fillrect_packet_t *p = (rpusbdisp_disp_fillrect_packet_t *)cur_buffer->head;
+        display_fillrect_rect(p, &r);
+        if (!display_rect_valid(display, &r))
+        {
+            ERR_DEV(cdev, "rect out of screen x:%d y:%d width:%d height:%d\n", r.x, r.y, r.w, r.h);
+            return;
+        }
+        display_rotate_rect(display, &r);
+        display_fill_rect(display, page, &r, le16_to_cpu(p->color_565), p->operation&RPUSBDISP_OPERATION_MASK);
+    }
+    else
+    {
+        display_copyarea_rect((rpusbdisp_disp_copyarea_packet_t *)cur_buffer->head, &src, &r);
+        if (!display_rect_valid(display, &src) || !display_rect_valid(display, &r))
+        {
+            ERR_DEV(cdev, "copy area out of screen sx:%d sy:%d dx:%d dy:%d width:%d height:%d\n",
+                    src.x, src.y, r.x, r.y, r.w, r.h);
+            return;
+        }
+        // 旋转以后还是平移
+        display_rotate_rect(display, &src);
+        display_rotate_rect(display, &r);
+        display_copy_area(display, page, &src, page, r.x, r.y);
+    }
+
+    if (display->flip_active)
+        display_damage_add(display, &r);
+}
+
+// 往矩形里画像素的命令
+// 解压一个lz4块，返回解出来的长度，出错返回负数
+static int display_lz4_decompress(const unsigned char *src, int src_len, unsigned char *dst, int dst_len)
+{
+// lib/lz4从3.11才有，3.10上没有CONFIG_LZ4_DECOMPRESS；4.11以前是老的接口
+#if !IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+    return -ENOSYS;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+    return LZ4_decompress_safe((const char *)src, (char *)dst, src_len, dst_len);
+#else
+    size_t len = dst_len;
+    int ret = lz4_decompress_unknownoutputsize(src, src_len, dst, &len);
+    return ret < 0 ? ret : (int)len;
+#endif
+}
+
+// lz4的匹配要回读前面解出来的数据，framebuffer多是write combine的，回读很慢，
+// 所以整块先解到内存里，再和bitblt一样分段拷到屏幕
+static int display_lz4_unpack(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    rpusbdisp_disp_bitblt_packet_t *p = (rpusbdisp_disp_bitblt_packet_t *)cur_buffer->head;
+    int size = le16_to_cpu(p->width)*le16_to_cpu(p->height)*RP_DISP_BYTES_PER_PIXEL;
+    int ret;
+
+#if IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+    if (!display->lz4_unpacked)
+        display->lz4_unpacked = vmalloc(display->width*display->height*RP_DISP_BYTES_PER_PIXEL);
+    if (!display->lz4_unpacked)
+    {
+        ERR_DEV(cdev, "no memory for bitblt lz4\n");
+        return 0;
+    }
+#else
+    ERR_DEV(cdev, "bitblt lz4 not support, kernel without CONFIG_LZ4_DECOMPRESS\n");
+    return 0;
+#endif
+
+    ret = display_lz4_decompress(cur_buffer->buffer, cur_buffer->count, display->lz4_unpacked, size);
+    if (ret != size)
+    {
+        ERR_DEV(cdev, "bitblt lz4 decompress fail(%d), expect %d bytes\n", ret, size);
+        return 0;
+    }
+    display->lz4_owner = cur_buffer;
+    cur_buffer->unpacked_len = size;
+    return 1;
+}
+
+// 检查各种bitblt包头里的参数，数据不够或者参数不支持返回0
+static int display_blit_check(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+
+    switch (cur_buffer->cmd)
+    {
+    case RPUSBDISP_DISPCMD_BITBLT_SCALED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED:
+        {
+            rpusbdisp_disp_bitblt_scaled_packet_t *p = (rpusbdisp_disp_bitblt_scaled_packet_t *)cur_buffer->head;
+            if (p->scale < 1 || p->scale > RPUSBDISP_SCALE_MAX)
+            {
+                ERR_DEV(cdev, "bitblt bad scale %d\n", p->scale);
+                return 0;
             }
-            else
+        }
+        break;
+    case RPUSBDISP_DISPCMD_BITBLT_INDEXED:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_INDEXED:
+        {
+            rpusbdisp_disp_bitblt_indexed_packet_t *p = (rpusbdisp_disp_bitblt_indexed_packet_t *)cur_buffer->head;
+            if (p->bpp != 8 && p->bpp != 4)
+            {
+                ERR_DEV(cdev, "bitblt bad bpp %d\n", p->bpp);
+                return 0;
+            }
+        }
+        break;
+    case RPUSBDISP_DISPCMD_BITBLT_YUV420:
+        {
+            // 三个平面要收全了才能按行找到对应的UV
+            rpusbdisp_disp_bitblt_yuv_packet_t *p = (rpusbdisp_disp_bitblt_yuv_packet_t *)cur_buffer->head;
+            int w = le16_to_cpu(p->width);
+            int h = le16_to_cpu(p->height);
+            int size = w*h + 2*((w + 1)/2)*((h + 1)/2);
+            if (p->format > RPUSBDISP_YUV_FORMAT_NV12 || p->matrix > RPUSBDISP_YUV_MATRIX_BT709)
+            {
+                ERR_DEV(cdev, "bitblt bad yuv format %d matrix %d\n", p->format, p->matrix);
+                return 0;
+            }
+            if (cur_buffer->count < size)
+            {
+                ERR_DEV(cdev, "bitblt yuv %dx%d needs %d bytes, got %d\n", w, h, size, cur_buffer->count);
+                return 0;
+            }
+        }
+        break;
+    }
+    return 1;
+}
+
+// 按命令的编码解一段到b里，画完返回1
+static int display_blit_step(struct f_display *display, struct display_buffer *cur_buffer,
+                             struct display_blit *b, int slice)
+{
+    rpusbdisp_disp_bitblt_indexed_packet_t *ip = (rpusbdisp_disp_bitblt_indexed_packet_t *)cur_buffer->head;
+
+    switch (cur_buffer->cmd)
+    {
+    case RPUSBDISP_DISPCMD_BITBLT:
+    case RPUSBDISP_DISPCMD_BITBLT_SCALED:
+        return display_bitblt_step(b, cur_buffer->buffer, cur_buffer->count, &cur_buffer->offset, slice);
+    case RPUSBDISP_DISPCMD_BITBLT_RLE:
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED:
+        return display_bitblt_rle_step(b, cur_buffer->buffer, cur_buffer->count, &cur_buffer->offset, slice);
+    case RPUSBDISP_DISPCMD_BITBLT_INDEXED:
+        return display_bitblt_indexed_step(b, &display->palette, ip->bpp,
+                                           cur_buffer->buffer, cur_buffer->count, &cur_buffer->offset, slice);
+    case RPUSBDISP_DISPCMD_BITBLT_RLE_INDEXED:
+        return display_bitblt_rle_indexed_step(b, &display->palette, ip->bpp,
+                                               cur_buffer->buffer, cur_buffer->count, &cur_buffer->offset, slice);
+    case RPUSBDISP_DISPCMD_BITBLT_YUV420:
+        return display_bitblt_yuv_step(b, (const rpusbdisp_disp_bitblt_yuv_packet_t *)cur_buffer->head,
+                                       cur_buffer->buffer, &cur_buffer->offset, slice);
+    case RPUSBDISP_DISPCMD_BITBLT_LZ4:
+        return display_bitblt_step(b, display->lz4_unpacked, cur_buffer->unpacked_len, &cur_buffer->offset, slice);
+    case RPUSBDISP_DISPCMD_BITBLT_RLE2D:
+        return display_bitblt_rle2d_step(b, &cur_buffer->src_blit,
+                                         cur_buffer->buffer, cur_buffer->count, &cur_buffer->offset, slice);
+    }
+    return 1;
+}
+
+// 主机更新调色板
+static void display_palette(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    struct display_palette *pal = &display->palette;
+    rpusbdisp_disp_palette_packet_t *p = (rpusbdisp_disp_palette_packet_t *)cur_buffer->head;
+    const unsigned short *colors = (const unsigned short *)cur_buffer->buffer;
+    int first = p->first;
+    int count = le16_to_cpu(p->count);
+    int i;
+
+    if (first + count > RPUSBDISP_PALETTE_SIZE || cur_buffer->count < count*RP_DISP_BYTES_PER_PIXEL)
+    {
+        ERR_DEV(cdev, "bad palette first:%d count:%d size:%d\n", first, count, cur_buffer->count);
+        return;
+    }
+
+    for (i=0; i<count; i++)
+        pal->color[first+i] = le16_to_cpu(colors[i]);
+
+    // 4位下标一个字节两个像素，内存里第一个像素在低16位
+    for (i=0; i<256; i++)
+        pal->pair[i] = pal->color[i>>4] | ((u32)pal->color[i&0x0f] << 16);
+}
+
+// 图块都不大，一次画完
+// TILE_DRAW用到的图块记一次命中或miss，命中的移到LRU最前面。
+// 关屏或者被后面的更新盖住不画时也要调用，缓存里丢掉哪个图块和主机推算的一样
+static struct display_tile *display_tile_use(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    rpusbdisp_disp_tile_draw_packet_t *p = (rpusbdisp_disp_tile_draw_packet_t *)cur_buffer->head;
+    struct display_tile *tile = display_tile_find(display, le32_to_cpu(p->id));
+
+    if (!tile)
+    {
+        display->tiles.misses++;
+        return NULL;
+    }
+    display->tiles.hits++;
+    list_move(&tile->lru, &display->tiles.lru);
+    return tile;
+}
+
+static void display_tile_draw(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    rpusbdisp_disp_tile_draw_packet_t *p = (rpusbdisp_disp_tile_draw_packet_t *)cur_buffer->head;
+    struct display_tile *tile = display_tile_use(display, cur_buffer);
+    struct display_rect rect;
+    int flags;
+
+    if (!tile)
+    {
+        ERR_DEV(cdev, "tile %u not cached\n", le32_to_cpu(p->id));
+        return;
+    }
+
+    display_buffer_rect(display, cur_buffer, &rect, &flags);
+    if (!display_rect_valid(display, &rect))
+    {
+        ERR_DEV(cdev, "tile out of screen x:%d y:%d width:%d height:%d\n", rect.x, rect.y, rect.w, rect.h);
+        return;
+    }
+
+    display_sync(display);
+    blit_init(display, &cur_buffer->blit, &rect, cur_buffer->scratch->strip);
+    blit_copy(&cur_buffer->blit, (const unsigned char *)tile->pixels, rect.w*rect.h);
+    blit_flush(&cur_buffer->blit);
+
+    if (display->flip_active)
+    {
+        display_rotate_rect(display, &rect);
+        display_damage_add(display, &rect);
+    }
+}
+
+// 画一个buffer，大的bitblt每次只画一段，画完返回1
+static int display_do_update(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    int done;
+
+    if (display_cmd_is_blit(cur_buffer->cmd))
+    {
+        rpusbdisp_disp_bitblt_scaled_packet_t *p = (rpusbdisp_disp_bitblt_scaled_packet_t *)cur_buffer->head;
+        int scaled = cur_buffer->cmd == RPUSBDISP_DISPCMD_BITBLT_SCALED ||
+            cur_buffer->cmd == RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED;
+        // 放大时先解到源图的blit里，一行解完放大到目标
+        struct display_blit *b = scaled ? &cur_buffer->src_blit : &cur_buffer->blit;
+        int slice = BLIT_SLICE_PIXELS;
+        struct display_codec_stats *stats = &display->stats[cur_buffer->cmd];
+        struct display_rect rect;
+        ktime_t start;
+        int flags;
+
+        display_buffer_rect(display, cur_buffer, &rect, &flags);
+        if (!cur_buffer->started)
+        {
+            if (!display_blit_check(display, cur_buffer))
+                return 1;
+            if (!display_rect_valid(display, &rect))
+            {
+                ERR_DEV(cdev, "bitblt out of screen x:%d y:%d width:%d height:%d\n", rect.x, rect.y, rect.w, rect.h);
+                return 1;
+            }
+            stats->commands++;
+            stats->bytes += display_cmd_head_size(cur_buffer->cmd) + cur_buffer->count;
+            stats->pixels += rect_area(&rect);
+            if (cur_buffer->cmd == RPUSBDISP_DISPCMD_BITBLT_LZ4)
+            {
+                start = ktime_get();
+                if (!display_lz4_unpack(display, cur_buffer))
+                    return 1;
+                stats->ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+            }
+
+            blit_init(display, &cur_buffer->blit, &rect, cur_buffer->scratch->strip);
+            if (scaled)
+                blit_init_scaled(&cur_buffer->src_blit, &cur_buffer->blit,
+                                 le16_to_cpu(p->width), le16_to_cpu(p->height),
+                                 cur_buffer->scratch->scale_rows, p->scale, p->filter);
+            else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_BITBLT_RLE2D)
+                blit_init_rows(&cur_buffer->src_blit, rect.w, rect.h, cur_buffer->scratch->scale_rows);
+            cur_buffer->offset = 0;
+            cur_buffer->started = 1;
+
+            if (display->flip_active)
+            {
+                display_rotate_rect(display, &rect);
+                display_damage_add(display, &rect);
+            }
+        }
+
+        // 每段画出去的像素数差不多
+        if (scaled)
+            slice = BLIT_SLICE_PIXELS/(p->scale*p->scale);
+
+        display_sync(display);
+        start = ktime_get();
+        done = display_blit_step(display, cur_buffer, b, slice);
+        // 旋转时这一段解出来还没写到屏幕的也写出去，下一段之前可能有别的更新插队
+        blit_flush(&cur_buffer->blit);
+        stats->ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+        return done;
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_FILL ||
+             cur_buffer->cmd == RPUSBDISP_DISPCMD_RECT ||
+             cur_buffer->cmd == RPUSBDISP_DISPCMD_COPY_AREA)
+    {
+        display_do_accel(display, cur_buffer);
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_COMMIT)
+    {
+        display_commit(display);
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_PALETTE)
+    {
+        display_palette(display, cur_buffer);
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_TILE_STORE)
+    {
+        display_tile_store(display, cur_buffer);
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_TILE_DRAW)
+    {
+        display_tile_draw(display, cur_buffer);
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_PRESENT)
+    {
+        display_present(display, (const rpusbdisp_disp_present_packet_t *)cur_buffer->head);
+    }
+    else if (cur_buffer->cmd == RPUSBDISP_DISPCMD_CURSOR_IMAGE)
+    {
+        display_cursor_image(display, cur_buffer);
+    }
+    return 1;
+}
+
+// 要画的区域和光标重叠时先把光标擦掉，返回1表示画完要再画回来
+static int display_cursor_hide_for(struct f_display *display, struct display_buffer *cur_buffer)
+{
+    int page = display_draw_page(display);
+    struct display_rect r;
+    int flags;
+
+    if (!display->cursor.drawn[page] || !display_buffer_rect(display, cur_buffer, &r, &flags))
+        return 0;
+    display_rotate_rect(display, &r);
+    if (!rect_intersect_area(&r, &display->cursor.rect[page]))
+        return 0;
+
+    display_cursor_hide(display, page);
+    return 1;
+}
+
+// 输出后端报告显示器关了或者开了，可能拿着console锁，只记下来交给工作队列
+static void display_blank(struct display_output *out, int blanked)
+{
+    struct f_display *display = container_of(out, struct f_display, out);
+
+    display->blanked = blanked;
+    if (!blanked)
+    {
+        display->unblanked = 1;
+        queue_work(display->wq, &display->work);
+    }
+}
+
+// 关屏时主机画的区域(主机坐标系)
+static void display_blank_damage_add(struct f_display *display, const struct display_rect *r)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&display->lock, flags);
+    rect_list_add(display->blank_damage, &display->blank_damage_count, r);
+    spin_unlock_irqrestore(&display->lock, flags);
+}
+
+// 开屏后屏幕上这些地方是旧的，告诉主机重发
+static void display_unblank(struct f_display *display)
+{
+    if (!display->unblanked)
+        return;
+    display->unblanked = 0;
+    if (display->blank_damage_count)
+        display_status_send(display, RPUSBDISP_DISPLAY_STATUS_DIRTY_FLAG);
+}
+
+// 前台页上logical区域(主机坐标系，不超过一个图块)的CRC，按主机的行顺序算，光标下面用被盖住的内容
+static u32 display_tile_crc(struct f_display *display, const struct display_rect *r)
+{
+    struct display_cursor *c = &display->cursor;
+    int front = display->front;
+    unsigned int line_length = display->out.line_length;
+    unsigned short *buf = display->crc_buf;
+    unsigned short row[RPUSBDISP_CRC_TILE_SIZE];
+    unsigned char __iomem *src;
+    struct display_rect p = *r;
+    struct display_rect o;
+    u32 crc = ~0;
+    int i, j, x, y;
+
+    display_rotate_rect(display, &p);
+    src = display_page_base(display, front) + p.y*line_length + p.x*RP_DISP_BYTES_PER_PIXEL;
+    for (i=0; i<p.h; i++, src+=line_length)
+        fb_memcpy_fromfb(buf + i*p.w, src, p.w*RP_DISP_BYTES_PER_PIXEL);
+
+    if (c->drawn[front] && rect_intersect(&o, &c->rect[front], &p))
+    {
+        const struct display_rect *cr = &c->rect[front];
+        for (i=0; i<o.h; i++)
+            memcpy(buf + (o.y - p.y + i)*p.w + o.x - p.x,
+                   c->save[front] + (o.y - cr->y + i)*cr->w + o.x - cr->x, o.w*RP_DISP_BYTES_PER_PIXEL);
+    }
+
+    if (!rotate)
+        return ~crc32_le(crc, (const unsigned char *)buf, p.w*p.h*RP_DISP_BYTES_PER_PIXEL);
+
+    for (j=0; j<r->h; j++)
+    {
+        for (i=0; i<r->w; i++)
+        {
+            x = i;
+            y = j;
+            rotate_point(r->w, r->h, &x, &y);
+            row[i] = buf[y*p.w + x];
+        }
+        crc = crc32_le(crc, (const unsigned char *)row, r->w*RP_DISP_BYTES_PER_PIXEL);
+    }
+    return ~crc;
+}
+
+// 回复主机的RPUSBDISP_CONTROL_TILE_CRC，超出屏幕的图块不回，数据比wLength短
+// 在setup里直接算好回复，和RPUSBDISP_CONTROL_DAMAGE一样，不会等工作队列。
+// 不等加速的操作也不和正在画的更新同步，读到画了一半的图块CRC对不上，主机多重发一次
+static int display_tile_crc_reply(struct f_display *display, int first, int length)
+{
+    struct usb_composite_dev *cdev = display->function.config->cdev;
+    struct usb_request *req = cdev->req;
+    __le32 *out = req->buf;
+    int tiles_x = DIV_ROUND_UP(display->width, RPUSBDISP_CRC_TILE_SIZE);
+    int tiles = tiles_x*DIV_ROUND_UP(display->height, RPUSBDISP_CRC_TILE_SIZE);
+    struct display_rect r;
+    int i, n;
+
+    n = min(length/(int)sizeof(u32), max(tiles - first, 0));
+    for (i=0; i<n; i++)
+    {
+        int tile = first + i;
+        r.x = (tile % tiles_x)*RPUSBDISP_CRC_TILE_SIZE;
+        r.y = (tile / tiles_x)*RPUSBDISP_CRC_TILE_SIZE;
+        r.w = min(display->width - r.x, RPUSBDISP_CRC_TILE_SIZE);
+        r.h = min(display->height - r.y, RPUSBDISP_CRC_TILE_SIZE);
+        out[i] = cpu_to_le32(display_tile_crc(display, &r));
+    }
+
+    req->length = n*sizeof(u32);
+    // 比主机要的短又正好是整包时要补零长包，不然主机一直等
+    req->zero = req->length < length;
+    return usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+}
+
+// 导出收到的命令，包头和USB上一样
+static void display_ring_export(struct f_display *display, struct display_buffer *buf)
+{
+    int head_size = display_cmd_head_size(buf->cmd);
+
+    if (!head_size)
+        head_size = display_cmd_short_size(buf->cmd);
+    display_ring_write(display->ring, buf->cmd, buf->head, head_size, buf->buffer, buf->count);
+}
+
+static void display_do_work(struct work_struct *work)
+{
+    struct f_display *display = container_of(work, struct f_display, work);
+    struct display_buffer *cur_buffer;
+    struct display_rect r;
+    int flags;
+    //struct usb_composite_dev *cdev = display->function.config->cdev;
+    //DBG_DEV(cdev, "in work irq count:%d\n", display->irq_count);
+    display->irq_count = 0;
+
+    display_cursor_update(display);
+    display_unblank(display);
+    while ((cur_buffer = display_buffer_next(display)) != NULL)
+    {
+        int cursor_hidden;
+
+        if (display->session_reset)
+        {
+            display->session_reset = 0;
+            display->flip_active = 0;
+            display->damage_count = 0;
+            display->present_synced = 0;
+            display->present_pending = 0;
+            // 新连接的主机不知道缓存里有什么
+            display_tile_clear(display);
+        }
+
+        if (!cur_buffer->started && display_buffer_superseded(display, cur_buffer))
+        {
+            if (cur_buffer->cmd == RPUSBDISP_DISPCMD_TILE_DRAW)
+                display_tile_use(display, cur_buffer);
+            cur_buffer->done = 1;
+        }
+        else if ((display->blanked || display->out.discard) && display_buffer_rect(display, cur_buffer, &r, &flags))
+        {
+            // 看不见的不用解码和写屏幕，调色板、图块等不画屏幕的命令还是要执行。
+            // 内容不留，开屏后靠主机重发记下的区域
+            if (cur_buffer->cmd == RPUSBDISP_DISPCMD_TILE_DRAW)
+                display_tile_use(display, cur_buffer);
+            if (display->blanked && display_rect_valid(display, &r))
+                display_blank_damage_add(display, &r);
+            cur_buffer->done = 1;
+            display_scratch_put(display, cur_buffer);
+        }
+        else
+        {
+            cursor_hidden = display_cursor_hide_for(display, cur_buffer);
+            display_scratch_get(display, cur_buffer);
+            if (display_do_update(display, cur_buffer))
             {
-                unsigned char * const data_origin = (unsigned char *)cur_buffer->buffer;
-                unsigned char *data = data_origin;
-                unsigned char section_head;
-                int copy_len = 0;
-                int cur_len = 0;
-                int i;
-                while ((data-data_origin) < cur_buffer->count)
+                cur_buffer->done = 1;
+                display_scratch_put(display, cur_buffer);
+                // 单缓冲时直接画在前台页上
+                if (!display->flip_active && display_buffer_rect(display, cur_buffer, &r, &flags) &&
+                    display_rect_valid(display, &r))
                 {
-                    section_head = data[0];
-                    data++;
-                    cur_len = ((section_head&RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT)+1)*RP_DISP_DEFAULT_PIXEL_BITS/8;
-                    if (section_head & RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT)
-                    {
-#if RP_DISP_DEFAULT_PIXEL_BITS != 16
-#error "not support now"
-#endif
-                        for (i=0; i<(cur_len/2); i++, dst+=2)
-                        {
-                            *(unsigned short *)dst = *(unsigned short *)data;
-                        }
-                        data+=2;
-                    }
-                    else
-                    {
-                        fb_memcpy_tofb(dst, data, cur_len);
-                        dst += cur_len;
-                        data += cur_len;
-                    }
-
-                    copy_len += cur_len;
+                    display_rotate_rect(display, &r);
+                    display_flush_add(display, &r);
                 }
-
-                //DBG_DEV(cdev, "fb copy:%d\n", copy_len);
             }
+            if (cursor_hidden)
+                display_cursor_show(display, display->front);
+        }
+
+        // 光标移动不等排队的更新
+        display_cursor_update(display);
+        display_unblank(display);
+
+        // 一直有更新进来时也至少每帧提交一次
+        if (display->flush_count &&
+            ktime_to_ns(ktime_sub(ktime_get(), display->flush_last)) >= ktime_to_ns(display->vsync_period))
+            display_flush(display);
 
-            //DBG_DEV(cdev, "fbinfo type:%d visual:%d bpp:%d %d %d %d\n", 
-            //        display->fb->fix.type,
-            //        display->fb->fix.visual,
-            //        display->fb->var.bits_per_pixel,
-            //        display->fb->var.red.offset,
-            //        display->fb->var.green.offset,
-            //        display->fb->var.blue.offset
-            //        );
+        // 插队画完的buffer要等前面的也画完才能释放，释放时是收到的顺序
+        while (display->buffer_used && display->buffer_tail->done)
+        {
+            if (display->ring)
+                display_ring_export(display, (struct display_buffer *)display->buffer_tail);
+            display_buffer_release(display);
         }
 
-        circular_buffer_incr(display, &display->buffer_tail);
+        cond_resched();
     }
-    else
+    display_flush(display);
+}
+
+static const char *display_codec_names[RPUSBDISP_CMD_MASK+1] = {
+    [RPUSBDISP_DISPCMD_BITBLT] = "bitblt",
+    [RPUSBDISP_DISPCMD_BITBLT_RLE] = "rle",
+    [RPUSBDISP_DISPCMD_BITBLT_SCALED] = "scaled",
+    [RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED] = "rle_scaled",
+    [RPUSBDISP_DISPCMD_BITBLT_INDEXED] = "indexed",
+    [RPUSBDISP_DISPCMD_BITBLT_RLE_INDEXED] = "rle_indexed",
+    [RPUSBDISP_DISPCMD_BITBLT_YUV420] = "yuv420",
+    [RPUSBDISP_DISPCMD_BITBLT_LZ4] = "lz4",
+    [RPUSBDISP_DISPCMD_BITBLT_RLE2D] = "rle2d",
+};
+
+// 最后两列是每1000个像素收到的字节数(RGB565不压缩是2000)，和每秒解码画出的像素数
+static int display_stats_show(struct seq_file *s, void *unused)
+{
+    struct f_display *display = s->private;
+    int i;
+
+    seq_printf(s, "%-12s %10s %14s %14s %12s %10s %12s\n",
+               "codec", "commands", "bytes", "pixels", "us", "B/kpixel", "pixel/s");
+    for (i=0; i<=RPUSBDISP_CMD_MASK; i++)
     {
-        ERR_DEV(cdev, "no fb:%p or empty buffer!\n", display->fb);
+        struct display_codec_stats *st = &display->stats[i];
+        u64 us = div_u64(st->ns, NSEC_PER_USEC);
+        if (!display_codec_names[i])
+            continue;
+        seq_printf(s, "%-12s %10llu %14llu %14llu %12llu %10llu %12llu\n",
+                   display_codec_names[i], st->commands, st->bytes, st->pixels, us,
+                   st->pixels ? div64_u64(st->bytes*1000, st->pixels) : 0,
+                   us ? div64_u64(st->pixels*USEC_PER_SEC, us) : 0);
     }
+    // 不同的buffer_alloc下比较pixel/s，能看出TLB的影响
+    seq_printf(s, "buffers: %s %lu KB%s\n", display_pool_names[display->pool_mode],
+               display->pool_pages*PAGE_SIZE/1024, display->pool ? "" : " (not allocated)");
+    return 0;
+}
+
+static int display_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, display_stats_show, inode->i_private);
+}
+
+static int display_tiles_show(struct seq_file *s, void *unused)
+{
+    struct f_display *display = s->private;
+    struct display_tile_cache *cache = &display->tiles;
+
+    // 在工作队列外面读，数字可能差一点，不影响看
+    seq_printf(s, "bytes: %u/%u\nhits: %llu\nmisses: %llu\nevictions: %llu\n",
+               cache->bytes, tile_cache_kb*1024, cache->hits, cache->misses, cache->evictions);
+    return 0;
+}
+
+static int display_tiles_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, display_tiles_show, inode->i_private);
+}
+
+static const struct file_operations display_tiles_fops = {
+    .owner = THIS_MODULE,
+    .open = display_tiles_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations display_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = display_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int display_rotation(void)
+{
+    return (rotate == 90 || rotate == 180 || rotate == 270) ? rotate : 0;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -459,17 +3448,23 @@ static void display_unbind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct f_display *display = func_to_display(f);
 
-    tasklet_disable(&display_tasklet);
+    cancel_delayed_work_sync(&display->idle_work);
+    cancel_delayed_work_sync(&display->alloc_work);
+    cancel_work_sync(&display->work);
+    // 先关输出后端，之后不会再有关屏通知来排工作
+    display_sync(display);
+    display->out.ops->close(&display->out);
+    destroy_workqueue(display->wq);
 
 	usb_free_all_descriptors(f);
-    vfree(display->buffers);
-
-    if (display->fb)
-    {
-        if (display->fb->fbops->fb_release)
-            display->fb->fbops->fb_release(display->fb, 0);
-        module_put(display->fb->fbops->owner);
-    }
+    kfree(display->status_req->buf);
+    usb_ep_free_request(display->in_ep, display->status_req);
+    debugfs_remove_recursive(display->debugfs);
+    if (display->ring)
+        display_ring_destroy(display->ring);
+    display_buffers_free(display);
+    kfree(display->buffers);
+    display_tile_clear(display);
 
 	kfree(display);
     DBG("display_unbind\n");
@@ -478,7 +3473,7 @@ static void display_unbind(struct usb_configuration *c, struct usb_function *f)
 int __init add_display_function(struct usb_configuration *c)
 {
     int ret;
-    struct fb_info *fb0 = NULL;
+    int frame_pages;
 	struct f_display *display = kzalloc(sizeof(struct f_display), GFP_KERNEL);
 	if (!display)
 		return -ENOMEM;
@@ -486,60 +3481,104 @@ int __init add_display_function(struct usb_configuration *c)
 	display->function.name = "display";
 	display->function.bind = display_bind;
 	display->function.set_alt = display_set_alt;
+	display->function.setup = display_setup;
 	display->function.disable = display_disable;
 	display->function.strings = display_strings;
 	//display->function.free_func = display_free_func;
     display->function.unbind = display_unbind;
-    display->buffers = vmalloc_32(sizeof(struct display_buffer)*BUFFER_COUNT);
+    display->buffers = kcalloc(BUFFER_COUNT, sizeof(struct display_buffer), GFP_KERNEL);
     if (!display->buffers)
     {
         ret = -ENOMEM;
         goto VMALLOC;
     }
-	memset(display->buffers, 0, sizeof(struct display_buffer)*BUFFER_COUNT); 
     display->buffer_head = display->buffers;
     display->buffer_tail = display->buffers;
+    spin_lock_init(&display->lock);
+    display_tile_init(display);
+
+    // pan_display要拿console锁会睡眠，不能在tasklet里画
+    INIT_WORK(&display->work, display_do_work);
+    INIT_DELAYED_WORK(&display->alloc_work, display_alloc_work);
+    INIT_DELAYED_WORK(&display->idle_work, display_idle_work);
+    display->wq = alloc_ordered_workqueue("usb_display", WQ_HIGHPRI);
+    if (!display->wq)
+    {
+        ret = -ENOMEM;
+        goto VMALLOC;
+    }
 
-    fb0 = registered_fb[0];
-    if (fb0)
+    display->out.blank = display_blank;
+    if (!strcmp(output, "drm"))
+        ret = display_drm_open(&display->out, page_flip);
+    else if (!strcmp(output, "fb"))
+        ret = display_fb_open(&display->out, page_flip);
+    else if (!strcmp(output, "ram") || !strcmp(output, "null"))
+        ret = display_ram_open(&display->out, page_flip, !strcmp(output, "null"));
+    else
     {
-        if (fb0->fbops->owner && !try_module_get(fb0->fbops->owner))
-        {
-            ERR("get framebuffer module error\n");
-            ret = -ENODEV;
-            goto VMALLOC;
-        }
+        ERR("unknown output %s\n", output);
+        ret = -EINVAL;
+    }
+    if (ret)
+        goto VMALLOC;
+    display->flip_capable = display->out.pages > 1;
+    display->front = 0;
 
-        if (fb0->fbops->fb_open)
+    if (rotate != 0 && rotate != 90 && rotate != 180 && rotate != 270)
+    {
+        ERR("rotate %u not support, use 0\n", rotate);
+        rotate = 0;
+    }
+    display->width = display->out.width;
+    display->height = display->out.height;
+    if (rotate == 90 || rotate == 270)
+    {
+        display->width = display->out.height;
+        display->height = display->out.width;
+    }
+    display->buffer_size = display_buffer_size(display->width, display->height);
+    frame_pages = DIV_ROUND_UP(display->buffer_size, PAGE_SIZE);
+    display->pool_pages = buffer_kb ? DIV_ROUND_UP(buffer_kb*1024, PAGE_SIZE) : 2*frame_pages;
+    if (display->pool_pages < frame_pages)
+        display->pool_pages = frame_pages;
+    display_vsync_init(display);
+
+    if (ring_kb)
+    {
+        display->ring = display_ring_create(ring_kb*1024);
+        if (IS_ERR(display->ring))
         {
-            mutex_lock(&fb0->lock);
-            if (fb0->fbops->fb_open(fb0, 0))
-            {
-                ERR("fb0 open fail\n");
-                mutex_unlock(&fb0->lock);
-                module_put(fb0->fbops->owner);
-                ret = -EBUSY;
-                goto VMALLOC;
-            }
-            mutex_unlock(&fb0->lock);
+            ret = PTR_ERR(display->ring);
+            display->ring = NULL;
+            goto OUTPUT;
         }
-        display->fb = fb0;
     }
-    else
+
+    // 没有debugfs时返回错误指针，统计看不到不影响显示
+    display->debugfs = debugfs_create_dir("usb_display", NULL);
+    if (!IS_ERR_OR_NULL(display->debugfs))
     {
-        ERR("no fb0\n");
-        ret = -ENODEV;
-        goto VMALLOC;
+        debugfs_create_file("codec_stats", S_IRUGO, display->debugfs, display, &display_stats_fops);
+        debugfs_create_file("tile_cache", S_IRUGO, display->debugfs, display, &display_tiles_fops);
     }
 
 	ret = usb_add_function(c, &display->function);
 	if (ret)
     {
-        goto VMALLOC;
+        goto OUTPUT;
     }
 
     return ret;
+OUTPUT:
+    debugfs_remove_recursive(display->debugfs);
+    if (display->ring)
+        display_ring_destroy(display->ring);
+    display->out.ops->close(&display->out);
 VMALLOC:
+    if (display->wq)
+        destroy_workqueue(display->wq);
+    kfree(display->buffers);
     kfree(display);
 	return ret;
 }
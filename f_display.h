@@ -1,4 +1,6 @@
 #ifndef __F_DISPLAY_H__
 #define __F_DISPLAY_H__
 int __init add_display_function(struct usb_configuration *c);
+// 屏幕转了多少度(rotate参数)，触摸坐标要跟着转
+int display_rotation(void);
 #endif
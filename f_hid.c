@@ -13,12 +13,41 @@
 #include <linux/module.h>
 #include <linux/hid.h>
 #include <linux/sched.h>
+#include <linux/ktime.h>
 #include <linux/usb/composite.h>
 
 #include "pixcir_i2c_ts.h"
 #include "f_hid.h"
+#include "f_display.h"
 #include "debug.h"
 
+// 触摸屏的分辨率，和报告描述符里的LOGICAL_MAXIMUM对应
+#define TOUCH_WIDTH  800
+#define TOUCH_HEIGHT 480
+
+// 多点触摸的digitizer报告，和s_fdesc里的报告描述符对应
+#define TOUCH_MAX_CONTACTS      PIXCIR_MAX_SLOTS
+#define TOUCH_REPORT_ID         1   // 输入报告
+#define TOUCH_REPORT_ID_MAX     2   // feature报告: 最多几个手指(Contact Count Maximum)
+
+struct touch_contact {
+    u8 tip;             // bit0: 手指按着
+    u8 id;              // 同一个手指从按下到抬起不变
+    __le16 x;
+    __le16 y;
+} __attribute__((packed));
+
+struct touch_hid_report {
+    u8 report_id;
+    struct touch_contact contacts[TOUCH_MAX_CONTACTS];
+    __le16 scan_time;   // 单位100us，循环计数
+    u8 count;           // contacts里前count个有效
+} __attribute__((packed));
+
+// 预先分配的触摸报告请求个数。端点上同时只放一个，其余的是待发的按下/抬起，
+// 移动只改最后一个待发报告的坐标，一般用不完
+#define TOUCH_REQ_COUNT 8
+
 
 /*-------------------------------------------------------------------------*/
 /*                            HID gadget struct                            */
@@ -33,6 +62,19 @@ struct f_hidg {
 	/* send report */
 	struct usb_function		func;
 	struct usb_ep			*in_ep;
+
+    // 空闲的报告请求，bind时分配好，发完放回来，触摸的路径上不分配内存
+    spinlock_t              lock;
+    struct list_head        free_reqs;
+    // 主机取得比触摸屏采样慢时不让旧的坐标排队: 端点上最多一个报告，
+    // 后面的等它发完再发，按下状态没变的只留最新的一个
+    struct usb_request      *in_flight;
+    struct list_head        pending_reqs;
+    unsigned int            coalesced;
+    unsigned int            dropped;
+
+    // 上一次报告里按着的手指，抬起时还要报一次tip为0的。只在触摸屏的中断线程里用
+    struct touch_hid_report last;
 };
 
 static inline struct f_hidg *func_to_hidg(struct usb_function *f)
@@ -127,9 +169,19 @@ static int hidg_setup(struct usb_function *f, const struct usb_ctrlrequest *ctrl
 		  | HID_REQ_GET_REPORT):
 		DBG_DEV(cdev, "get_report\n");
 
+		// 主机问最多支持几个手指，wValue高字节3是feature报告
+		if ((value >> 8) == 3 && (value & 0xff) == TOUCH_REPORT_ID_MAX) {
+			((u8 *)req->buf)[0] = TOUCH_REPORT_ID_MAX;
+			((u8 *)req->buf)[1] = TOUCH_MAX_CONTACTS;
+			length = min_t(unsigned, length, 2);
+			goto respond;
+		}
+
 		/* send an empty report */
 		length = min_t(unsigned, length, hidg->report_length);
 		memset(req->buf, 0x0, length);
+		if (length)
+			((u8 *)req->buf)[0] = TOUCH_REPORT_ID;
 
 		goto respond;
 		break;
@@ -235,6 +287,166 @@ fail:
 	return status;
 }
 
+// 端点上的报告发不出去了(断开、端点关了)，它和待发的都放回空闲链表
+static void touch_reqs_flush(struct f_hidg *hidg, struct usb_request *req)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&hidg->lock, flags);
+    hidg->in_flight = NULL;
+    list_add_tail(&req->list, &hidg->free_reqs);
+    list_splice_tail_init(&hidg->pending_reqs, &hidg->free_reqs);
+    spin_unlock_irqrestore(&hidg->lock, flags);
+}
+
+static void touch_req_queue(struct f_hidg *hidg, struct usb_request *req)
+{
+    int result;
+
+    req->status = 0;
+    req->zero = 0;
+    result = usb_ep_queue(hidg->in_ep, req, GFP_ATOMIC);
+    if (result)
+    {
+        // 主机还没设置接口等情况，每个触摸事件都会来一次，限一下速
+        if (printk_ratelimit())
+            DBG("%s queue req fail --> %d\n", hidg->in_ep->name, result);
+        touch_reqs_flush(hidg, req);
+    }
+}
+
+static void f_touch_req_complete(struct usb_ep *ep, struct usb_request *req)
+{
+    struct f_hidg *hidg = req->context;
+    struct usb_request *next = NULL;
+    unsigned long flags;
+
+    if (req->status != 0) 
+    {
+        ERR("touch request fail!\n");
+        touch_reqs_flush(hidg, req);
+        return;
+    }
+
+    // 放回空闲链表，接着发下一个待发的
+    spin_lock_irqsave(&hidg->lock, flags);
+    list_add_tail(&req->list, &hidg->free_reqs);
+    if (!list_empty(&hidg->pending_reqs))
+    {
+        next = list_first_entry(&hidg->pending_reqs, struct usb_request, list);
+        list_del(&next->list);
+    }
+    hidg->in_flight = next;
+    spin_unlock_irqrestore(&hidg->lock, flags);
+
+    if (next)
+        touch_req_queue(hidg, next);
+}
+
+// 手指个数、每个手指的ID和按下状态都一样，只是坐标和扫描时间不同
+static int touch_report_same_state(const struct touch_hid_report *a, const struct touch_hid_report *b)
+{
+    int i;
+
+    if (a->count != b->count)
+        return 0;
+    for (i=0; i<a->count; i++)
+    {
+        if (a->contacts[i].tip != b->contacts[i].tip || a->contacts[i].id != b->contacts[i].id)
+            return 0;
+    }
+    return 1;
+}
+
+// 发一个报告。端点上已经有报告时放到待发的后面，最后一个待发报告只是移动(和它前面的
+// 报告状态一样)、状态也和这个一样时直接换成新的，主机拿到的总是最新的坐标。
+// 按下、抬起的报告不换，按下的位置不会被后来的坐标挪走
+static void touch_report(struct f_hidg *hidg, const struct touch_hid_report *report)
+{
+    struct usb_request *req, *last, *before;
+    unsigned long flags;
+
+    spin_lock_irqsave(&hidg->lock, flags);
+    if (!list_empty(&hidg->pending_reqs))
+    {
+        last = list_entry(hidg->pending_reqs.prev, struct usb_request, list);
+        if (last->list.prev != &hidg->pending_reqs)
+            before = list_entry(last->list.prev, struct usb_request, list);
+        else
+            before = hidg->in_flight;
+        if (before && touch_report_same_state(before->buf, last->buf) &&
+            touch_report_same_state(last->buf, report))
+        {
+            memcpy(last->buf, report, sizeof(*report));
+            hidg->coalesced++;
+            spin_unlock_irqrestore(&hidg->lock, flags);
+            return;
+        }
+    }
+    if (list_empty(&hidg->free_reqs))
+    {
+        hidg->dropped++;
+        spin_unlock_irqrestore(&hidg->lock, flags);
+        // 主机不取报告时每个触摸事件都会走到这里，个数已经记在dropped里
+        if (printk_ratelimit())
+            DBG("no free touch request, dropped %u\n", hidg->dropped);
+        return;
+    }
+    req = list_first_entry(&hidg->free_reqs, struct usb_request, list);
+    list_del(&req->list);
+    memcpy(req->buf, report, sizeof(*report));
+    req->length = sizeof(*report);
+    if (hidg->in_flight)
+    {
+        list_add_tail(&req->list, &hidg->pending_reqs);
+        req = NULL;
+    }
+    else
+    {
+        hidg->in_flight = req;
+    }
+    spin_unlock_irqrestore(&hidg->lock, flags);
+
+    if (req)
+        touch_req_queue(hidg, req);
+}
+
+static void touch_reqs_free(struct f_hidg *hidg)
+{
+    struct usb_request *req, *tmp;
+
+    list_splice_tail_init(&hidg->pending_reqs, &hidg->free_reqs);
+    list_for_each_entry_safe(req, tmp, &hidg->free_reqs, list)
+    {
+        list_del(&req->list);
+        kfree(req->buf);
+        usb_ep_free_request(hidg->in_ep, req);
+    }
+}
+
+static int touch_reqs_alloc(struct f_hidg *hidg)
+{
+    struct usb_request *req;
+    int i;
+
+    for (i=0; i<TOUCH_REQ_COUNT; i++)
+    {
+        req = usb_ep_alloc_request(hidg->in_ep, GFP_KERNEL);
+        if (!req)
+            return -ENOMEM;
+        req->buf = kmalloc(hidg->report_length, GFP_KERNEL);
+        if (!req->buf)
+        {
+            usb_ep_free_request(hidg->in_ep, req);
+            return -ENOMEM;
+        }
+        req->complete = f_touch_req_complete;
+        req->context = hidg;
+        list_add_tail(&req->list, &hidg->free_reqs);
+    }
+    return 0;
+}
+
 static int __init hidg_bind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct usb_ep		*ep;
@@ -271,10 +483,15 @@ static int __init hidg_bind(struct usb_configuration *c, struct usb_function *f)
 	if (status)
 		goto fail;
 
+	status = touch_reqs_alloc(hidg);
+	if (status)
+		goto fail;
+
 	return 0;
 
 fail:
 	ERROR(f->config->cdev, "hidg_bind FAILED\n");
+	touch_reqs_free(hidg);
 	usb_free_all_descriptors(f);
 	return status;
 }
@@ -287,56 +504,92 @@ static void hidg_unbind(struct usb_configuration *c, struct usb_function *f)
 	/* disable/free request and end point */
 	//usb_ep_disable(hidg->in_ep);
 	usb_free_all_descriptors(f);
+    // disable时端点上的请求都已经完成回到空闲链表
+    touch_reqs_free(hidg);
 
 	kfree(hidg->report_desc);
 	kfree(hidg);
     DBG("hidg_unbind\n");
 }
 
-static void f_touch_req_complete(struct usb_ep *ep, struct usb_request *req)
+// 屏幕旋转时触摸坐标跟着转到主机看到的方向
+static void touch_rotate(int *x, int *y)
 {
-	//struct f_hidg *hidg = (struct f_hidg *)ep->driver_data;
-    if (req->status != 0) 
+    int t;
+
+    *x = clamp(*x, 0, TOUCH_WIDTH - 1);
+    *y = clamp(*y, 0, TOUCH_HEIGHT - 1);
+    switch (display_rotation())
     {
-        ERR("touch request fail!\n");
+    case 90:
+        t = *x;
+        *x = *y;
+        *y = TOUCH_WIDTH - 1 - t;
+        break;
+    case 180:
+        *x = TOUCH_WIDTH - 1 - *x;
+        *y = TOUCH_HEIGHT - 1 - *y;
+        break;
+    case 270:
+        t = *x;
+        *x = TOUCH_HEIGHT - 1 - *y;
+        *y = t;
+        break;
     }
-    else
+}
+
+static int touch_contact_find(const struct touch_hid_report *r, int id)
+{
+    int i;
+
+    for (i=0; i<r->count; i++)
     {
-        DBG("touch request OK\n");
+        if (r->contacts[i].id == id)
+            return i;
     }
-
-    // just release it 
-	kfree(req->buf);
-	usb_ep_free_request(ep, req);
+    return -1;
 }
 
-static void touch_callback(int touch, int x, int y, void *data)
+// 一次扫描的所有手指放在一个报告里，主机做手势不用等几个报告
+static void touch_callback(const struct pixcir_report_data *report, void *data)
 {
 	struct f_hidg *hidg = (struct f_hidg *)data;
-    char mouse_data[5] = {touch, x, x>>8, y, y>>8};
-	struct usb_request *req = usb_ep_alloc_request(hidg->in_ep, GFP_ATOMIC);
-	if (req) {
-		req->length = sizeof(mouse_data);
-		req->buf = kmalloc(req->length, GFP_ATOMIC);
-		if (req->buf)
-        {
-            int result;
-            req->status   = 0;
-            req->zero     = 0;
-            req->complete = f_touch_req_complete;
-            memcpy(req->buf, mouse_data, sizeof(mouse_data));
-            result = usb_ep_queue(hidg->in_ep, req, GFP_ATOMIC);
-            if (result)
-                DBG("%s queue req fail --> %d\n", hidg->in_ep->name, result);
-		}
-        else
+    struct touch_hid_report r;
+    int i, x, y;
+
+    memset(&r, 0, sizeof(r));
+    r.report_id = TOUCH_REPORT_ID;
+    for (i=0; i<report->num_touches && r.count<TOUCH_MAX_CONTACTS; i++)
+    {
+        struct touch_contact *c = &r.contacts[r.count++];
+        x = report->touches[i].x;
+        y = report->touches[i].y;
+        touch_rotate(&x, &y);
+        c->tip = 1;
+        c->id = report->touches[i].id;
+        c->x = cpu_to_le16(x);
+        c->y = cpu_to_le16(y);
+    }
+
+    // 上一次按着这一次没有的手指，在原来的位置报一次抬起
+    for (i=0; i<hidg->last.count && r.count<TOUCH_MAX_CONTACTS; i++)
+    {
+        if (touch_contact_find(&r, hidg->last.contacts[i].id) < 0)
         {
-			usb_ep_free_request(hidg->in_ep, req);
-			req = NULL;
+            r.contacts[r.count] = hidg->last.contacts[i];
+            r.contacts[r.count].tip = 0;
+            r.count++;
         }
-	}
+    }
 
-    DBG("touch:%d x:%d y:%d\n", touch, x, y);
+    // 一直没有手指时不用发
+    if (!r.count)
+        return;
+
+    hidg->last = r;
+    hidg->last.count = min_t(int, report->num_touches, TOUCH_MAX_CONTACTS);
+    r.scan_time = cpu_to_le16(div_u64(ktime_to_us(ktime_get()), 100));
+    touch_report(hidg, &r);
 }
 /*-------------------------------------------------------------------------*/
 /*                                 Strings                                 */
@@ -360,48 +613,92 @@ static struct usb_gadget_strings *ct_func_strings[] = {
 
 /*-------------------------------------------------------------------------*/
 /*                             usb_configuration                           */
+// 一个手指的逻辑集合: tip switch、contact ID、X、Y，和struct touch_contact对应
+#define TOUCH_FINGER_DESC \
+    0x09, 0x22,                    /* USAGE (Finger) */ \
+    0xa1, 0x02,                    /* COLLECTION (Logical) */ \
+    0x09, 0x42,                    /*   USAGE (Tip Switch) */ \
+    0x15, 0x00,                    /*   LOGICAL_MINIMUM (0) */ \
+    0x25, 0x01,                    /*   LOGICAL_MAXIMUM (1) */ \
+    0x75, 0x01,                    /*   REPORT_SIZE (1) */ \
+    0x95, 0x01,                    /*   REPORT_COUNT (1) */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */ \
+    0x95, 0x07,                    /*   REPORT_COUNT (7) */ \
+    0x81, 0x03,                    /*   INPUT (Cnst,Var,Abs) */ \
+    0x09, 0x51,                    /*   USAGE (Contact Identifier) */ \
+    0x26, 0xff, 0x00,              /*   LOGICAL_MAXIMUM (255) */ \
+    0x75, 0x08,                    /*   REPORT_SIZE (8) */ \
+    0x95, 0x01,                    /*   REPORT_COUNT (1) */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */ \
+    0x05, 0x01,                    /*   USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x30,                    /*   USAGE (X) */ \
+    0x26, 0x1f, 0x03,              /*   LOGICAL_MAXIMUM (799) */ \
+    0x75, 0x10,                    /*   REPORT_SIZE (16) */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */ \
+    0x09, 0x31,                    /*   USAGE (Y) */ \
+    0x26, 0xdf, 0x01,              /*   LOGICAL_MAXIMUM (479) */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */ \
+    0x05, 0x0d,                    /*   USAGE_PAGE (Digitizers) */ \
+    0xc0,                          /* END_COLLECTION */
+
 static struct hidg_func_descriptor __initdata s_fdesc = {
 	.subclass = 0,
-	.protocol = USB_INTERFACE_PROTOCOL_MOUSE,
-    // 中断数据长度(按键(1)，X(2), Y(2))
-	.report_length = 5,
-	.report_desc_length = 64,
+	.protocol = 0,
+    // 中断数据长度，见struct touch_hid_report
+	.report_length = sizeof(struct touch_hid_report),
+	.report_desc_length = 307,
 	.report_desc = {
-        0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
-        0x09, 0x02,                    // USAGE (Mouse)
+        0x05, 0x0d,                    // USAGE_PAGE (Digitizers)
+        0x09, 0x04,                    // USAGE (Touch Screen)
         0xa1, 0x01,                    // COLLECTION (Application)
-        0x09, 0x01,                    //   USAGE (Pointer)
-        0xa1, 0x00,                    //   COLLECTION (Physical)
-        0x05, 0x09,                    //     USAGE_PAGE (Button)
-        0x19, 0x01,                    //     USAGE_MINIMUM (Button 1)
-        0x29, 0x03,                    //     USAGE_MAXIMUM (Button 3)
-        0x15, 0x00,                    //     LOGICAL_MINIMUM (0)
-        0x25, 0x01,                    //     LOGICAL_MAXIMUM (1)
-        0x95, 0x03,                    //     REPORT_COUNT (3)
-        0x75, 0x01,                    //     REPORT_SIZE (1)
-        0x81, 0x02,                    //     INPUT (Data,Var,Abs)
-        0x95, 0x01,                    //     REPORT_COUNT (1)
-        0x75, 0x05,                    //     REPORT_SIZE (5)
-        0x81, 0x03,                    //     INPUT (Cnst,Var,Abs)
-        0x05, 0x01,                    //     USAGE_PAGE (Generic Desktop)
-        0x09, 0x30,                    //     USAGE (X)
-        0x15, 0x00,                    //     LOGICAL_MINIMUM (0)
-        0x26, 0x1f, 0x03,              //     LOGICAL_MAXIMUM (799)
-        0x75, 0x10,                    //     REPORT_SIZE (16)
-        0x95, 0x01,                    //     REPORT_COUNT (1)
-        0x81, 0x02,                    //     INPUT (Data,Var,Abs)
-        0x05, 0x01,                    //     USAGE_PAGE (Generic Desktop)
-        0x09, 0x31,                    //     USAGE (Y)
-        0x15, 0x00,                    //     LOGICAL_MINIMUM (0)
-        0x26, 0xdf, 0x01,              //     LOGICAL_MAXIMUM (479)
-        0x75, 0x10,                    //     REPORT_SIZE (16)
-        0x95, 0x01,                    //     REPORT_COUNT (1)
-        0x81, 0x02,                    //     INPUT (Data,Var,Abs)
-        0xc0,                          //   END_COLLECTION
+        0x85, TOUCH_REPORT_ID,         //   REPORT_ID (TOUCH_REPORT_ID)
+        TOUCH_FINGER_DESC                      //   手指0
+        TOUCH_FINGER_DESC                      //   手指1
+        TOUCH_FINGER_DESC                      //   手指2
+        TOUCH_FINGER_DESC                      //   手指3
+        TOUCH_FINGER_DESC                      //   手指4
+        0x09, 0x56,                    //   USAGE (Scan Time)
+        0x55, 0x0c,                    //   UNIT_EXPONENT (-4)
+        0x66, 0x01, 0x10,              //   UNIT (Seconds)
+        0x27, 0xff, 0xff, 0x00, 0x00,  //   LOGICAL_MAXIMUM (65535)
+        0x75, 0x10,                    //   REPORT_SIZE (16)
+        0x95, 0x01,                    //   REPORT_COUNT (1)
+        0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+        0x55, 0x00,                    //   UNIT_EXPONENT (0)
+        0x65, 0x00,                    //   UNIT (None)
+        0x09, 0x54,                    //   USAGE (Contact Count)
+        0x25, 0x7f,                    //   LOGICAL_MAXIMUM (127)
+        0x75, 0x08,                    //   REPORT_SIZE (8)
+        0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+        0x85, TOUCH_REPORT_ID_MAX,     //   REPORT_ID (TOUCH_REPORT_ID_MAX)
+        0x09, 0x55,                    //   USAGE (Contact Count Maximum)
+        0x25, TOUCH_MAX_CONTACTS,      //   LOGICAL_MAXIMUM (TOUCH_MAX_CONTACTS)
+        0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
         0xc0                           // END_COLLECTION
     },
 };
 
+// 把报告描述符里每个usage(X/Y)后面的LOGICAL_MAXIMUM改成max，每个手指都有一组
+static void hidg_set_logical_max(char *desc, int length, unsigned char usage, int max)
+{
+    int i, j;
+
+    for (i=0; i+1<length; i++)
+    {
+        if ((unsigned char)desc[i] != 0x09 || (unsigned char)desc[i+1] != usage)
+            continue;
+        for (j=i+2; j+2<length; j++)
+        {
+            if ((unsigned char)desc[j] == 0x26)
+            {
+                desc[j+1] = max;
+                desc[j+2] = max>>8;
+                break;
+            }
+        }
+    }
+}
+
 int __init add_hid_function(struct usb_configuration *c)
 {
 	struct f_hidg *hidg;
@@ -430,6 +727,16 @@ int __init add_hid_function(struct usb_configuration *c)
 		kfree(hidg);
 		return -ENOMEM;
 	}
+    spin_lock_init(&hidg->lock);
+    INIT_LIST_HEAD(&hidg->free_reqs);
+    INIT_LIST_HEAD(&hidg->pending_reqs);
+
+    // 竖屏时主机看到的宽高对调
+    if (display_rotation() == 90 || display_rotation() == 270)
+    {
+        hidg_set_logical_max(hidg->report_desc, hidg->report_desc_length, 0x30, TOUCH_HEIGHT - 1);
+        hidg_set_logical_max(hidg->report_desc, hidg->report_desc_length, 0x31, TOUCH_WIDTH - 1);
+    }
 
 	hidg->func.name    = "hid";
 	hidg->func.strings = ct_func_strings;
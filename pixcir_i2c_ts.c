@@ -35,7 +35,11 @@
 static usb_touch_callback g_fun;
 static void * g_data;
 
-#define PIXCIR_MAX_SLOTS       5 /* Max fingers supported by driver */
+// 0: 控制器坐标变了才拉ATTB(PIXCIR_INT_DIFF_COORD)，每次中断读一次，按控制器的扫描速度报告；
+// 有的板子ATTB的边沿不可靠，设成采样频率(Hz)时退回手指按着就一直读的方式，用hrtimer定时
+static unsigned int touch_poll_hz;
+module_param(touch_poll_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(touch_poll_hz, "0 to read the touch controller on every coordinate change interrupt, or poll at this rate (Hz) while touched");
 
 struct pixcir_i2c_ts_data {
     struct i2c_client *client;
@@ -45,18 +49,8 @@ struct pixcir_i2c_ts_data {
     int max_fingers;        /* Max fingers supported in this instance */
 };
 
-struct pixcir_touch {
-    int x;
-    int y;
-    int id;
-};
-
-struct pixcir_report_data {
-    int num_touches;
-    struct pixcir_touch touches[PIXCIR_MAX_SLOTS];
-};
-
-static void pixcir_ts_parse(struct pixcir_i2c_ts_data *tsdata,
+// 读一次扫描结果，I2C失败返回负数，这时report里没有有效的数据
+static int pixcir_ts_parse(struct pixcir_i2c_ts_data *tsdata,
         struct pixcir_report_data *report)
 {
     u8 rdbuf[2 + PIXCIR_MAX_SLOTS * 5];
@@ -79,7 +73,7 @@ static void pixcir_ts_parse(struct pixcir_i2c_ts_data *tsdata,
         dev_err(&tsdata->client->dev,
                 "%s: i2c_master_send failed(), ret=%d\n",
                 __func__, ret);
-        return;
+        return ret < 0 ? ret : -EIO;
     }
 
     //dev_err(&tsdata->client->dev, "readsize %d, max_fingers %d", readsize, tsdata->max_fingers);
@@ -90,7 +84,7 @@ static void pixcir_ts_parse(struct pixcir_i2c_ts_data *tsdata,
         dev_err(&tsdata->client->dev,
                 "%s: i2c_master_recv failed(), ret=%d\n",
                 __func__, ret);
-        return;
+        return ret < 0 ? ret : -EIO;
     }
 
     touch = rdbuf[0] & 0x7;
@@ -112,6 +106,8 @@ static void pixcir_ts_parse(struct pixcir_i2c_ts_data *tsdata,
             bufptr = bufptr + 4;
         }
     }
+
+    return 0;
 }
 
 static void pixcir_ts_report(struct pixcir_i2c_ts_data *ts,
@@ -150,6 +146,8 @@ static void pixcir_ts_report(struct pixcir_i2c_ts_data *ts,
             }
         } else {
             slot = slots[i];
+            // 没有硬件ID时用input_mt分配的slot跟踪手指，报给主机的contact ID也用它
+            touch->id = slot;
         }
 
         input_mt_slot(ts->input, slot);
@@ -172,18 +170,31 @@ static irqreturn_t pixcir_ts_isr(int irq, void *dev_id)
     struct pixcir_i2c_ts_data *tsdata = dev_id;
     const struct pixcir_ts_platform_data *pdata = tsdata->pdata;
     struct pixcir_report_data report;
-    int x_old = 0;
-    int y_old = 0;
+    unsigned long period_us;
+    int error;
 
+    // 每个中断是一次新的扫描结果，抬起时手指个数变成0也会来一次中断。
+    // 读失败时不报，不然input和主机都以为手指抬起来了
+    if (!touch_poll_hz) {
+        if (tsdata->running && !pixcir_ts_parse(tsdata, &report)) {
+            pixcir_ts_report(tsdata, &report);
+            if (g_fun)
+                g_fun(&report, g_data);
+        }
+        return IRQ_HANDLED;
+    }
+
+    period_us = USEC_PER_SEC / touch_poll_hz;
     while (tsdata->running) {
         /* parse packet */
-        pixcir_ts_parse(tsdata, &report);
+        error = pixcir_ts_parse(tsdata, &report);
 
         /* report it */
-        pixcir_ts_report(tsdata, &report);
+        if (!error)
+            pixcir_ts_report(tsdata, &report);
 
         if (gpio_get_value(pdata->gpio_attb)) {
-            if (report.num_touches) {
+            if (!error && report.num_touches) {
                 /*
                  * Last report with no finger up?
                  * Do it now then.
@@ -192,23 +203,21 @@ static irqreturn_t pixcir_ts_isr(int irq, void *dev_id)
                 input_sync(tsdata->input);
             }
 
-            // only support one touch
+            // 手指都抬起来了
             if (g_fun)
             {
-                g_fun(0, x_old, y_old, g_data);
+                report.num_touches = 0;
+                g_fun(&report, g_data);
             }
             break;
         }
 
-        // only support one touch
-        if (g_fun)
-        {
-            g_fun(1, report.touches[0].x, report.touches[0].y, g_data);
-            x_old = report.touches[0].x;
-            y_old = report.touches[0].y;
-        }
+        // 一次扫描到的所有手指一起交给USB
+        if (!error && g_fun)
+            g_fun(&report, g_data);
 
-        msleep(20);
+        // usleep_range用hrtimer，不会像msleep那样按jiffies多睡
+        usleep_range(period_us, period_us + period_us / 8);
     }
 
     return IRQ_HANDLED;
@@ -314,8 +323,12 @@ static int pixcir_start(struct pixcir_i2c_ts_data *ts)
     struct device *dev = &ts->client->dev;
     int error;
 
-    /* LEVEL_TOUCH interrupt with active low polarity */
-    error = pixcir_set_int_mode(ts, PIXCIR_INT_LEVEL_TOUCH, 0);
+    /*
+     * DIFF_COORD (or LEVEL_TOUCH when polling) interrupt with
+     * active low polarity
+     */
+    error = pixcir_set_int_mode(ts, touch_poll_hz ? PIXCIR_INT_LEVEL_TOUCH :
+            PIXCIR_INT_DIFF_COORD, 0);
     if (error) {
         dev_err(dev, "Failed to set interrupt mode: %d\n", error);
         return error;
@@ -519,6 +532,12 @@ static int pixcir_i2c_ts_probe(struct i2c_client *client,
         return -EINVAL;
     }
 
+    // 超过1MHz时周期是0，轮询会变成空转
+    if (touch_poll_hz > USEC_PER_SEC) {
+        dev_err(dev, "Invalid touch_poll_hz %u\n", touch_poll_hz);
+        return -EINVAL;
+    }
+
     tsdata = devm_kzalloc(dev, sizeof(*tsdata), GFP_KERNEL);
     if (!tsdata)
         return -ENOMEM;
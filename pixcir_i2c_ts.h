@@ -62,7 +62,21 @@ struct pixcir_ts_platform_data {
         struct pixcir_i2c_chip_data chip;
 };
 
-typedef void (* usb_touch_callback)(int touch, int x, int y, void *data);
+#define PIXCIR_MAX_SLOTS       5 /* Max fingers supported by driver */
+
+struct pixcir_touch {
+        int x;
+        int y;
+        int id;         /* hardware tracking ID, or the input_mt slot */
+};
+
+struct pixcir_report_data {
+        int num_touches;
+        struct pixcir_touch touches[PIXCIR_MAX_SLOTS];
+};
+
+/* called once per scan, num_touches is 0 when all fingers are lifted */
+typedef void (* usb_touch_callback)(const struct pixcir_report_data *report, void *data);
 
 extern int pixcir_init(usb_touch_callback fun, void *data);
 extern void pixcir_exit(void);
@@ -1,138 +1,301 @@
-/* 
- *  RoboPeak Project
- *  Copyright 2009 - 2013
- *
- *  RP USB Display
- *  Protocol Def
- *  
- *  Initial Version by Shikai Chen
- */
-
-#pragma once
-
-typedef __u8  _u8;
-typedef __u16 _u16;
-typedef __u32 _u32;
-typedef __u64 _u64;
-
-typedef __s8  _s8;
-typedef __s16 _s16;
-typedef __s32 _s32;
-typedef __s64 _s64;
-
-
-#define RPUSBDISP_DISP_CHANNEL_MAX_SIZE    64 //64bytes
-#define RPUSBDISP_STATUS_CHANNEL_MAX_SIZE  32 //32bytes
-
-
-// -- Display Packets
-#define RPUSBDISP_DISPCMD_NOPE             0
-#define RPUSBDISP_DISPCMD_FILL             1  
-#define RPUSBDISP_DISPCMD_BITBLT           2
-#define RPUSBDISP_DISPCMD_RECT             3
-#define RPUSBDISP_DISPCMD_COPY_AREA        4
-#define RPUSBDISP_DISPCMD_BITBLT_RLE       5
-
-
-#define RPUSBDISP_OPERATION_COPY            0
-#define RPUSBDISP_OPERATION_XOR             1
-#define RPUSBDISP_OPERATION_OR              2
-#define RPUSBDISP_OPERATION_AND             3
-
-#if defined(_WIN32) || defined(__ICCARM__)
-#pragma pack(1)
-#endif
-
-
-#define RPUSBDISP_CMD_MASK                  (0x3F)
-#define RPUSBDISP_CMD_FLAG_CLEARDITY        (0x1<<6)
-#define RPUSBDISP_CMD_FLAG_START            (0x1<<7)
-typedef struct _rpusbdisp_disp_packet_header_t {
-#if 0
-    _u8 cmd:6; 
-    _u8 cleardirty:1;
-    _u8 start:1;
-#else
-    _u8 cmd_flag;
-#endif
-} __attribute__((packed)) rpusbdisp_disp_packet_header_t;
-
-
-typedef struct _rpusbdisp_disp_fill_packet_t {
-    rpusbdisp_disp_packet_header_t header;
-    _u16 color_565;
-} __attribute__((packed)) rpusbdisp_disp_fill_packet_t;
-
-
-typedef struct _rpusbdisp_disp_bitblt_packet_t {
-    rpusbdisp_disp_packet_header_t header;
-    _u16 x;
-    _u16 y;
-    _u16 width;
-    _u16 height;
-    _u8  operation;
-} __attribute__((packed)) rpusbdisp_disp_bitblt_packet_t;
-
-
-typedef struct _rpusbdisp_disp_fillrect_packet_t {
-    rpusbdisp_disp_packet_header_t header;
-    _u16 left;
-    _u16 top;
-    _u16 right;
-    _u16 bottom;
-    _u16 color_565;
-    _u8  operation;
-} __attribute__((packed)) rpusbdisp_disp_fillrect_packet_t;
-
-
-typedef struct _rpusbdisp_disp_copyarea_packet_t {
-    rpusbdisp_disp_packet_header_t header;
-    _u16 sx;
-    _u16 sy;
-    _u16 dx;
-    _u16 dy;
-    _u16 width;
-    _u16 height;
-} __attribute__((packed)) rpusbdisp_disp_copyarea_packet_t;
-
-#if defined(_WIN32) || defined(__ICCARM__)
-#pragma pack()
-#endif
-
-
-// RLE Packet Define
-#define RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT        0x80
-#define RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT          0x7f
-
-// -- Status Packets
-
-#define RPUSBDISP_STATUS_TYPE_NORMAL  0
-
-
-#define RPUSBDISP_DISPLAY_STATUS_DIRTY_FLAG   0x80  //a full screen transfer is required
-
-
-#define RPUSBDISP_TOUCH_STATUS_NO_TOUCH       0
-#define RPUSBDISP_TOUCH_STATUS_PRESSED        1
-
-#if defined(_WIN32) || defined(__ICCARM__)
-#pragma pack(1)
-#endif
-
-
-typedef struct _rpusbdisp_status_packet_header_t {
-    _u8 packet_type;
-} __attribute__((packed)) rpusbdisp_status_packet_header_t;
-
-
-typedef struct _rpusbdisp_status_normal_packet_t {
-    rpusbdisp_status_packet_header_t header;
-    _u8 display_status;
-    _u8 touch_status;
-    _s32 touch_x;
-    _s32 touch_y;
-} __attribute__((packed)) rpusbdisp_status_normal_packet_t;
-
-#if defined(_WIN32) || defined(__ICCARM__)
-#pragma pack()
-#endif
+/* 
+ *  RoboPeak Project
+ *  Copyright 2009 - 2013
+ *
+ *  RP USB Display
+ *  Protocol Def
+ *  
+ *  Initial Version by Shikai Chen
+ */
+
+#pragma once
+
+typedef __u8  _u8;
+typedef __u16 _u16;
+typedef __u32 _u32;
+typedef __u64 _u64;
+
+typedef __s8  _s8;
+typedef __s16 _s16;
+typedef __s32 _s32;
+typedef __s64 _s64;
+
+
+#define RPUSBDISP_DISP_CHANNEL_MAX_SIZE    64 //64bytes
+#define RPUSBDISP_STATUS_CHANNEL_MAX_SIZE  32 //32bytes
+
+
+// -- Display Packets
+#define RPUSBDISP_DISPCMD_NOPE             0
+#define RPUSBDISP_DISPCMD_FILL             1  
+#define RPUSBDISP_DISPCMD_BITBLT           2
+#define RPUSBDISP_DISPCMD_RECT             3
+#define RPUSBDISP_DISPCMD_COPY_AREA        4
+#define RPUSBDISP_DISPCMD_BITBLT_RLE       5
+#define RPUSBDISP_DISPCMD_COMMIT           6  // flip the frame drawn so far (page flip mode)
+#define RPUSBDISP_DISPCMD_PRESENT          7  // target presentation time of the following frame
+#define RPUSBDISP_DISPCMD_CURSOR_IMAGE     8  // upload the cursor sprite
+#define RPUSBDISP_DISPCMD_CURSOR_MOVE      9  // move, show or hide the cursor sprite
+#define RPUSBDISP_DISPCMD_BITBLT_SCALED    10 // bitblt upscaled by an integer factor on the device
+#define RPUSBDISP_DISPCMD_BITBLT_RLE_SCALED 11
+#define RPUSBDISP_DISPCMD_PALETTE          12 // load palette entries for the indexed bitblts
+#define RPUSBDISP_DISPCMD_BITBLT_INDEXED   13 // bitblt of 8 or 4 bit palette indices
+#define RPUSBDISP_DISPCMD_BITBLT_RLE_INDEXED 14
+#define RPUSBDISP_DISPCMD_BITBLT_YUV420    15 // bitblt of yuv 4:2:0, converted to rgb565 on the device
+#define RPUSBDISP_DISPCMD_BITBLT_LZ4       16 // bitblt header followed by one lz4 block of the rgb565 pixels
+#define RPUSBDISP_DISPCMD_BITBLT_RLE2D     17 // bitblt header followed by RPUSBDISP_RLE2D_OP_xxx sections
+#define RPUSBDISP_DISPCMD_TILE_STORE       18 // store a tile in the device cache
+#define RPUSBDISP_DISPCMD_TILE_DRAW        19 // draw a cached tile
+
+
+#define RPUSBDISP_OPERATION_COPY            0
+#define RPUSBDISP_OPERATION_XOR             1
+#define RPUSBDISP_OPERATION_OR              2
+#define RPUSBDISP_OPERATION_AND             3
+#define RPUSBDISP_OPERATION_MASK            0x0F
+#define RPUSBDISP_OPERATION_FLAG_URGENT     0x80  // latency critical, may overtake queued updates
+
+#if defined(_WIN32) || defined(__ICCARM__)
+#pragma pack(1)
+#endif
+
+
+#define RPUSBDISP_CMD_MASK                  (0x3F)
+#define RPUSBDISP_CMD_FLAG_CLEARDITY        (0x1<<6)
+#define RPUSBDISP_CMD_FLAG_START            (0x1<<7)
+typedef struct _rpusbdisp_disp_packet_header_t {
+#if 0
+    _u8 cmd:6; 
+    _u8 cleardirty:1;
+    _u8 start:1;
+#else
+    _u8 cmd_flag;
+#endif
+} __attribute__((packed)) rpusbdisp_disp_packet_header_t;
+
+
+typedef struct _rpusbdisp_disp_fill_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 color_565;
+} __attribute__((packed)) rpusbdisp_disp_fill_packet_t;
+
+
+typedef struct _rpusbdisp_disp_bitblt_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 x;
+    _u16 y;
+    _u16 width;
+    _u16 height;
+    _u8  operation;
+} __attribute__((packed)) rpusbdisp_disp_bitblt_packet_t;
+
+
+typedef struct _rpusbdisp_disp_fillrect_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 left;
+    _u16 top;
+    _u16 right;
+    _u16 bottom;
+    _u16 color_565;
+    _u8  operation;
+} __attribute__((packed)) rpusbdisp_disp_fillrect_packet_t;
+
+
+typedef struct _rpusbdisp_disp_copyarea_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 sx;
+    _u16 sy;
+    _u16 dx;
+    _u16 dy;
+    _u16 width;
+    _u16 height;
+} __attribute__((packed)) rpusbdisp_disp_copyarea_packet_t;
+
+
+typedef struct _rpusbdisp_disp_present_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u32 timestamp_us;  // host clock in microseconds, wraps around
+} __attribute__((packed)) rpusbdisp_disp_present_packet_t;
+
+
+#define RPUSBDISP_SCALE_MAX                 8
+
+#define RPUSBDISP_SCALE_FILTER_NEAREST      0
+#define RPUSBDISP_SCALE_FILTER_BILINEAR     1
+
+typedef struct _rpusbdisp_disp_bitblt_scaled_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 x;         // destination position
+    _u16 y;
+    _u16 width;     // source size, the destination is width*scale x height*scale
+    _u16 height;
+    _u8  operation;
+    _u8  scale;     // 1..RPUSBDISP_SCALE_MAX
+    _u8  filter;    // RPUSBDISP_SCALE_FILTER_xxx
+    // followed by the source pixels, raw or rle like bitblt
+} __attribute__((packed)) rpusbdisp_disp_bitblt_scaled_packet_t;
+
+
+#define RPUSBDISP_PALETTE_SIZE              256
+
+typedef struct _rpusbdisp_disp_palette_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u8  first;     // first entry to load
+    _u16 count;     // entries, first+count <= RPUSBDISP_PALETTE_SIZE
+    // followed by count rgb565 colors
+} __attribute__((packed)) rpusbdisp_disp_palette_packet_t;
+
+
+typedef struct _rpusbdisp_disp_bitblt_indexed_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 x;
+    _u16 y;
+    _u16 width;
+    _u16 height;
+    _u8  operation;
+    _u8  bpp;       // 8 or 4
+    // followed by palette indices. 4 bit indices are packed two per byte,
+    // high nibble first, continuing across rows. In the rle variant every
+    // section starts on a byte boundary and a common section carries one
+    // index byte.
+} __attribute__((packed)) rpusbdisp_disp_bitblt_indexed_packet_t;
+
+
+#define RPUSBDISP_YUV_FORMAT_I420           0 // Y plane, U plane, V plane
+#define RPUSBDISP_YUV_FORMAT_NV12           1 // Y plane, interleaved UV plane
+
+#define RPUSBDISP_YUV_MATRIX_BT601          0 // limited range
+#define RPUSBDISP_YUV_MATRIX_BT709          1 // limited range
+
+typedef struct _rpusbdisp_disp_bitblt_yuv_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 x;
+    _u16 y;
+    _u16 width;
+    _u16 height;
+    _u8  operation;
+    _u8  format;    // RPUSBDISP_YUV_FORMAT_xxx
+    _u8  matrix;    // RPUSBDISP_YUV_MATRIX_xxx
+    // followed by width*height luma bytes, then the chroma planes subsampled
+    // to ((width+1)/2)*((height+1)/2) samples each
+} __attribute__((packed)) rpusbdisp_disp_bitblt_yuv_packet_t;
+
+
+#define RPUSBDISP_TILE_MAX_PIXELS           16384
+
+typedef struct _rpusbdisp_disp_tile_store_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u32 id;        // chosen by the host, a counter or a hash of the pixels
+    _u16 width;
+    _u16 height;    // width*height <= RPUSBDISP_TILE_MAX_PIXELS
+    // followed by width*height rgb565 pixels
+} __attribute__((packed)) rpusbdisp_disp_tile_store_packet_t;
+
+
+typedef struct _rpusbdisp_disp_tile_draw_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u32 id;
+    _u16 x;
+    _u16 y;
+    _u8  operation;
+} __attribute__((packed)) rpusbdisp_disp_tile_draw_packet_t;
+
+
+#define RPUSBDISP_CURSOR_MAX_SIZE           64
+
+typedef struct _rpusbdisp_disp_cursor_image_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _u16 width;
+    _u16 height;
+    _u16 hot_x;
+    _u16 hot_y;
+    // followed by width*height rgb565 pixels, then width*height alpha bytes
+} __attribute__((packed)) rpusbdisp_disp_cursor_image_packet_t;
+
+
+typedef struct _rpusbdisp_disp_cursor_move_packet_t {
+    rpusbdisp_disp_packet_header_t header;
+    _s16 x;     // hot spot position
+    _s16 y;
+    _u8  visible;
+} __attribute__((packed)) rpusbdisp_disp_cursor_move_packet_t;
+
+#if defined(_WIN32) || defined(__ICCARM__)
+#pragma pack()
+#endif
+
+
+// RLE Packet Define
+#define RPUSBDISP_RLE_BLOCKFLAG_COMMON_BIT        0x80
+#define RPUSBDISP_RLE_BLOCKFLAG_SIZE_BIT          0x7f
+
+// 2D RLE Packet Define
+// Every section starts with one byte: the opcode in the top two bits and
+// count-1 in the low six. Like the RLE sections they run on across rows.
+// "Above" is the pixel at the same column one row up, black on the first row.
+#define RPUSBDISP_RLE2D_OP_MASK                   0xc0
+#define RPUSBDISP_RLE2D_OP_LITERAL                0x00  // count pixels follow
+#define RPUSBDISP_RLE2D_OP_RUN                    0x40  // one pixel follows, repeated count times
+#define RPUSBDISP_RLE2D_OP_ABOVE                  0x80  // copy count pixels from the row above
+#define RPUSBDISP_RLE2D_OP_ROWS                   0xc0  // copy the rest of the row from above, then repeat it count-1 more rows
+#define RPUSBDISP_RLE2D_COUNT_BIT                 0x3f
+
+// -- Control Requests
+// vendor requests to the display interface
+
+// IN, wValue is the first tile, wLength a multiple of 4. Returns the CRC-32
+// (as zlib's crc32) of each 32x32 tile of the shown screen, tiles numbered
+// row by row, edge tiles clipped. Each tile is hashed row by row over its
+// little endian rgb565 pixels; the cursor sprite is not included.
+#define RPUSBDISP_CONTROL_TILE_CRC          0x01
+#define RPUSBDISP_CRC_TILE_SIZE             32
+
+// IN. Returns up to wLength/8 rpusbdisp_rect_t, the areas the host drew
+// while the panel was blanked and the device skipped, then forgets the ones
+// returned; whatever did not fit in wLength is kept for the next read.
+// The device sets RPUSBDISP_DISPLAY_STATUS_DIRTY_FLAG on unblank when there
+// are any; a host that does not ask simply resends the full screen. The
+// device keeps no content drawn while blanked, so a host that ignores the
+// status packet shows stale pixels there until it redraws them.
+#define RPUSBDISP_CONTROL_DAMAGE            0x02
+
+// -- Status Packets
+
+#define RPUSBDISP_STATUS_TYPE_NORMAL  0
+
+
+#define RPUSBDISP_DISPLAY_STATUS_DIRTY_FLAG   0x80  //a full screen transfer is required
+
+
+#define RPUSBDISP_TOUCH_STATUS_NO_TOUCH       0
+#define RPUSBDISP_TOUCH_STATUS_PRESSED        1
+
+#if defined(_WIN32) || defined(__ICCARM__)
+#pragma pack(1)
+#endif
+
+
+typedef struct _rpusbdisp_status_packet_header_t {
+    _u8 packet_type;
+} __attribute__((packed)) rpusbdisp_status_packet_header_t;
+
+
+typedef struct _rpusbdisp_rect_t {
+    _u16 x;
+    _u16 y;
+    _u16 width;
+    _u16 height;
+} __attribute__((packed)) rpusbdisp_rect_t;
+
+
+typedef struct _rpusbdisp_status_normal_packet_t {
+    rpusbdisp_status_packet_header_t header;
+    _u8 display_status;
+    _u8 touch_status;
+    _s32 touch_x;
+    _s32 touch_y;
+} __attribute__((packed)) rpusbdisp_status_normal_packet_t;
+
+#if defined(_WIN32) || defined(__ICCARM__)
+#pragma pack()
+#endif